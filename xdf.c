@@ -19,6 +19,9 @@
 
 typedef unsigned long long int Bytes;
 
+/* Room for a human readable size with a colored unit. */
+#define HR_SIZE (NUM_SIZE + 3 + COLOR_SIZE + 3)
+
 typedef struct {
     /* Bytes / 1024. */
     Bytes in_kbytes;
@@ -27,7 +30,7 @@ typedef struct {
     Bytes in_bytes;
 
     /* Human readable textual representation. */
-    char *human_readable;
+    char human_readable[HR_SIZE];
 
     /* Number of digits in kbytes. */
     size_t num_digits;
@@ -36,6 +39,14 @@ typedef struct {
     size_t hr_length;
 } Size;
 
+/* Ways to print the filesystems, json and csv are meant for other
+   programs and have no colours or padding. */
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV
+} Output_format;
+
 typedef struct {
     /* Device filesystem name (i.e. /dev/sda1) */
     char *devfs;
@@ -73,20 +84,23 @@ static Option f_show_all = 0;
 
 static Option f_no_color = 0;
 
+/* --format. */
+static Output_format output_format = FORMAT_TEXT;
+
 /* Pseudo and virtual filesystems to ignore if f_ignore_special
    is set to zero. */
 static const char *SPECIAL_FS[] = { "devfs", "debugfs", "procfs", "tmpfs", "specfs", "sysfs" };
 
 static void usage(void);
-static char *human_readable(long double);
-static char *bytes_to_str(Bytes);
+static void set_format(const char *);
+static size_t human_readable(char *, Bytes);
 static void free_mtab_entry(Mtab_entry *);
 static Mtab_entry *get_mtab_entry(FILE *);
-static int bytes_count_digits(Bytes );
 
 static Flag flags[] = {
     { "human-readable", 'h', &f_human_readable , NULL     },
     { "no-color",       'C', &f_no_color,        NULL     },
+    { "format",         ' ', NULL,               NULL,    set_format },
     { "help",           ' ', NULL,               usage    },
     { NULL, 0, NULL, NULL }
 };
@@ -110,29 +124,38 @@ usage(void)
     puts("df");
 }
 
-static char * 
-human_readable(long double size)
+static void
+set_format(const char *arg)
 {
-    int i = 0;
-    const char* units[] = {"B ", "kB", "MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
-    char *unit;
-    char *hr;
-    
-    while (size > 1024) {
-        size /= 1024;
-        i++;
-    }
-
-    hr = xmalloc(255);
-    
-    if (f_no_color)
-        unit = dupstr(units[i]);
+    if (streq(arg, "text"))
+        output_format = FORMAT_TEXT;
     else
-        unit = color_string(C_BLUE, CT_NORMAL, units[i]);
+    if (streq(arg, "json"))
+        output_format = FORMAT_JSON;
+    else
+    if (streq(arg, "csv"))
+        output_format = FORMAT_CSV;
+    else {
+        xerror("invalid argument '%s' for '--format'", arg);
+        exit(EXIT_FAILURE);
+    }
+}
 
-    sprintf(hr, "%.1Lf %s", size, unit);
-    free(unit);
-    return hr;
+/* Writes size with one decimal and its unit to buf, which holds 
+   HR_SIZE bytes. Returns the length. */
+static size_t
+human_readable(char *buf, Bytes size)
+{
+    static const char *units[] = {"B ", "kB", "MB", "GB", "TB", "PB", "EB"};
+    int scale = size_scale(size);
+    size_t len = format_fixed(buf, size, 10 * scale, 1);
+
+    buf[len++] = ' ';
+    if (f_no_color) {
+        memcpy(buf + len, units[scale], 3);
+        return len + 2;
+    }
+    return len + color_append(buf + len, C_BLUE, CT_NORMAL, units[scale], 2);
 }
 
 static Size *
@@ -142,37 +165,18 @@ new_size(Bytes b)
 
     size->in_kbytes = b / 1024;
     size->in_bytes = b;
-    size->human_readable = human_readable(b);
-    size->hr_length = strlen(size->human_readable);
-    size->num_digits = bytes_count_digits(size->in_kbytes);
+    size->hr_length = size->num_digits = 0;
 
-    return size;
-}
+    /* Records have the raw number only. */
+    if (output_format != FORMAT_TEXT)
+        return size;
 
-static char *
-bytes_to_str(Bytes b)
-{
-    char *str;
-
-    str = xmalloc(255);
-    sprintf(str, "%lld", b);
-    return str;
-}
-
-static int
-bytes_count_digits(Bytes b)
-{
-    int digits = 0;
+    size->hr_length = human_readable(size->human_readable, b);
+    size->num_digits = count_digits(size->in_kbytes);
 
-    while (b > 0) {
-        b /= 10;
-        digits++;
-    }
-
-    return digits;
+    return size;
 }
 
-
 static void
 free_mtab_entry(Mtab_entry *entry)
 {
@@ -298,7 +302,8 @@ get_mtab_entry(FILE *mt)
     else
         entry->use = (int)((long double)((entry->used->in_bytes * 100) / entry->size->in_bytes));
     
-    store_longest(entry);
+    if (output_format == FORMAT_TEXT)
+        store_longest(entry);
 
     return entry;
 }
@@ -326,67 +331,68 @@ read_mtab(void)
    return 1;
 }
 
+/* Size of a field colored by color_field(), devfs and mountpoint
+   are at most 255 bytes, as are the sizes. */
+#define FIELD_SIZE (255 + COLOR_SIZE + 1)
+
+static char *
+color_field(char *buf, const Color color, const Color_type type, const char *str)
+{
+    color_append(buf, color, type, str, strlen(str));
+    return buf;
+}
+
 static void
 print_fs_color(const Mtab_entry *entry)
 {
-    char *cdevfs, *csize, *cused, *cavail, *cuse, *cmountp;
+    char cdevfs[FIELD_SIZE], csize[FIELD_SIZE], cused[FIELD_SIZE];
+    char cavail[FIELD_SIZE], cuse[FIELD_SIZE], cmountp[FIELD_SIZE];
+    Color devfs_color = C_WHITE;
 
     if (ignore_fs(entry->type))
         return;
 
-    cdevfs = NULL;
-
     for (size_t i = 0; COLOR_ASSOC[i].fs != NULL; ++i)
     {
         if (streq(COLOR_ASSOC[i].fs, entry->type))
         {
-            cdevfs = color_string(COLOR_ASSOC[i].color, CT_NORMAL, entry->devfs);
+            devfs_color = COLOR_ASSOC[i].color;
             break;
         }
     }
 
-    if (cdevfs == NULL)
-        cdevfs = color_string(C_WHITE, CT_NORMAL, entry->devfs);
+    color_field(cdevfs, devfs_color, CT_NORMAL, entry->devfs);
 
     if (f_human_readable)
     {
-        cused   = color_string(C_WHITE, CT_DARK, entry->used->human_readable);
-        csize   = color_string(C_WHITE, CT_DARK, entry->size->human_readable);
-        cavail  = color_string(C_WHITE, CT_DARK, entry->avail->human_readable);
+        color_field(cused,  C_WHITE, CT_DARK, entry->used->human_readable);
+        color_field(csize,  C_WHITE, CT_DARK, entry->size->human_readable);
+        color_field(cavail, C_WHITE, CT_DARK, entry->avail->human_readable);
     }
     else
     {
-        char *used, *size, *avail;
-        used  = bytes_to_str(entry->used->in_kbytes);
-        size  = bytes_to_str(entry->size->in_kbytes);
-        avail = bytes_to_str(entry->avail->in_kbytes);
-
-        cused  = color_string(C_WHITE, CT_DARK, used);
-        csize  = color_string(C_WHITE, CT_DARK, size);
-        cavail = color_string(C_WHITE, CT_DARK, avail);
-
-        free(used);
-        free(size);
-        free(avail);
+        char num[NUM_SIZE];
+
+        color_append(cused,  C_WHITE, CT_DARK, num, format_num(num, entry->used->in_kbytes));
+        color_append(csize,  C_WHITE, CT_DARK, num, format_num(num, entry->size->in_kbytes));
+        color_append(cavail, C_WHITE, CT_DARK, num, format_num(num, entry->avail->in_kbytes));
     }
   
-    char *use = xmalloc(5);
+    char use[16];
     sprintf(use, "%d%%", entry->use);
 
     if (entry->use < 25)
-        cuse = color_string(C_GREEN, CT_DARK, use);
+        color_field(cuse, C_GREEN, CT_DARK, use);
     else 
     if (entry->use < 50)
-        cuse = color_string(C_BROWN, CT_LIGHT, use);
+        color_field(cuse, C_BROWN, CT_LIGHT, use);
     else
     if (entry->use < 75)
-        cuse = color_string(C_BROWN, CT_DARK,  use);
+        color_field(cuse, C_BROWN, CT_DARK,  use);
     else
-        cuse = color_string(C_RED,   CT_LIGHT, use);
+        color_field(cuse, C_RED,   CT_LIGHT, use);
 
-    free(use);
-
-    cmountp = color_string(C_WHITE, CT_DARK, entry->mountpoint);
+    color_field(cmountp, C_WHITE, CT_DARK, entry->mountpoint);
     fprintf(stdout, "%-*s %*s %*s %*s %*s %-*s\n", 
             ldevfs + COLOR_SIZE  , cdevfs,  
             lsize  + COLOR_SIZE , csize,
@@ -394,13 +400,6 @@ print_fs_color(const Mtab_entry *entry)
             lavail + COLOR_SIZE , cavail,  
             luse   + COLOR_SIZE , cuse,
             lmountp + COLOR_SIZE , cmountp);
-
-    free(cdevfs);
-    free(cuse);
-    free(csize);
-    free(cused);
-    free(cavail);
-    free(cmountp);
 }
 
 static void
@@ -431,6 +430,67 @@ print_fs(Mtab_entry *entry)
 
 }
 
+/* Print entry as a JSON object on a line of its own, or a CSV row. */
+static void
+print_fs_record(const Mtab_entry *entry)
+{
+    if (ignore_fs(entry->type) || entry->size == NULL)
+        return;
+
+    if (output_format == FORMAT_JSON) {
+        out_puts("{\"filesystem\":");
+        out_json_string(entry->devfs);
+        out_puts(",\"type\":");
+        out_json_string(entry->type);
+        out_puts(",\"mountpoint\":");
+        out_json_string(entry->mountpoint);
+        out_puts(",\"size\":");
+        out_num(entry->size->in_bytes);
+        out_puts(",\"used\":");
+        out_num(entry->used->in_bytes);
+        out_puts(",\"avail\":");
+        out_num(entry->avail->in_bytes);
+        out_puts(",\"free\":");
+        out_num(entry->free->in_bytes);
+        out_puts(",\"use\":");
+        out_num(entry->use);
+        out_write("}\n", 2);
+        return;
+    }
+
+    out_csv_field(entry->devfs);
+    out_char(',');
+    out_csv_field(entry->type);
+    out_char(',');
+    out_csv_field(entry->mountpoint);
+    out_char(',');
+    out_num(entry->size->in_bytes);
+    out_char(',');
+    out_num(entry->used->in_bytes);
+    out_char(',');
+    out_num(entry->avail->in_bytes);
+    out_char(',');
+    out_num(entry->free->in_bytes);
+    out_char(',');
+    out_num(entry->use);
+    out_char('\n');
+}
+
+/* Print every entry with --format, straight to the output buffer. */
+static void
+print_records(void)
+{
+    if (output_format == FORMAT_CSV)
+        out_puts("filesystem,type,mountpoint,size,used,avail,free,use\n");
+
+    for (size_t i = 0; i < num_entries; ++i)
+    {
+        print_fs_record(entries[i]);
+        free_mtab_entry(entries[i]);
+    }
+    out_flush();
+}
+
 void
 df(char **args)
 {
@@ -448,6 +508,12 @@ df(char **args)
     
     read_mtab();
 
+    if (output_format != FORMAT_TEXT)
+    {
+        print_records();
+        return;
+    }
+
     int sp = 0;
 
     if (!f_no_color)
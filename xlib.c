@@ -1,16 +1,118 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "xlib.h"
 
-static const char *COLOR_FORMAT = "\033[%d;%dm";
 static const char *COLOR_RESET  = "\033[0m";
 
+#define COLOR_CODES(type) {                                          \
+    "\033[" #type ";30m", "\033[" #type ";31m", "\033[" #type ";32m", \
+    "\033[" #type ";33m", "\033[" #type ";34m", "\033[" #type ";35m", \
+    "\033[" #type ";36m", "\033[" #type ";37m"                        \
+}
+
+/* Escape sequence for every Color_type and Color, all of them
+   COLOR_CODE_SIZE bytes long. */
+static const char color_codes[CT_DARK + 1][C_WHITE - C_BLACK + 1][COLOR_CODE_SIZE + 1] = {
+    COLOR_CODES(0),
+    COLOR_CODES(1),
+    COLOR_CODES(2)
+};
+
+#define OUT_BUFFER_SIZE (64 * 1024)
+
+static char out_buf[OUT_BUFFER_SIZE];
+static size_t out_len = 0;
+
+typedef struct {
+    /* User or group id. */
+    unsigned long id;
+
+    /* Name belonging to id, NULL if the slot is empty. */
+    char *name;
+} Id_entry;
+
+typedef struct {
+    /* Database to load the table from. */
+    const char *path;
+
+    /* Open addressed slots, size is always a power of two. */
+    Id_entry *entries;
+    size_t size;
+
+    /* Number of used slots. */
+    size_t count;
+
+    /* Set once path has been read. */
+    int loaded;
+} Id_table;
+
+static Id_table passwd_table = { "/etc/passwd", NULL, 0, 0, 0 };
+static Id_table group_table  = { "/etc/group",  NULL, 0, 0, 0 };
+
+/* On disk index of both tables, stored in ~/.xutils so short lived
+   processes don't have to parse the databases at all. */
+#define ID_INDEX_FILE    ".xutils/idindex"
+#define ID_INDEX_MAGIC   0x58494458 /* "XIDX" */
+#define ID_INDEX_VERSION 1
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+} Id_source;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+
+    /* Identity of /etc/passwd and /etc/group when the index was built. */
+    Id_source passwd;
+    Id_source group;
+
+    /* Entries sorted by id, users first, followed by the groups
+       and a string heap with the names. */
+    uint32_t num_users;
+    uint32_t num_groups;
+    uint64_t heap_size;
+} Id_index_header;
+
+typedef struct {
+    uint32_t id;
+
+    /* Offset of the name in the string heap. */
+    uint32_t name;
+} Id_index_entry;
+
+typedef struct {
+    const Id_index_entry *entries;
+    size_t count;
+} Id_index_table;
+
+/* Set once we've tried to map the index. */
+static int id_index_checked = 0;
+
+/* Non zero if the index is mapped and up to date. */
+static int id_index_valid = 0;
+
+static Id_index_table index_users, index_groups;
+static const char *index_heap;
+static size_t index_heap_size;
+
 void *
 xmalloc(size_t size)
 {
@@ -43,6 +145,95 @@ xrealloc(void *p, size_t size)
     return ptr;
 }
 
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN     16
+
+struct arena_block {
+    Arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static Arena_block *
+arena_block(size_t size)
+{
+    Arena_block *block = xmalloc(sizeof(Arena_block) + size);
+
+    block->next = NULL;
+    block->used = 0;
+    block->size = size;
+    return block;
+}
+
+void
+arena_init(Arena *arena)
+{
+    arena->blocks = NULL;
+    arena->block_size = ARENA_MIN_BLOCK;
+}
+
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+    Arena_block *block = arena->blocks;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    /* Large allocations get a block of their own, behind the 
+       current one so it keeps being filled. */
+    if (size > ARENA_MAX_BLOCK / 4) {
+        Arena_block *large = arena_block(size);
+
+        if (block == NULL)
+            arena->blocks = large;
+        else {
+            large->next = block->next;
+            block->next = large;
+        }
+        large->used = size;
+        return large->data;
+    }
+
+    if (block == NULL || block->size - block->used < size) {
+        while (arena->block_size < size)
+            arena->block_size *= 2;
+
+        block = arena_block(arena->block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+
+        if (arena->block_size < ARENA_MAX_BLOCK)
+            arena->block_size *= 2;
+    }
+
+    p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+char *
+arena_strdup(Arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+void
+arena_free(Arena *arena)
+{
+    Arena_block *block, *next;
+
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena_init(arena);
+}
+
 void
 xfree(void *p)
 {
@@ -127,70 +318,106 @@ free_array(char **p, const size_t size)
     free(p);
 }
 
+const char *
+color_code(const Color color, const Color_type type)
+{
+    return color_codes[type][color - C_BLACK];
+}
+
+size_t
+color_append(char *buf, const Color color, const Color_type type, const char *data, size_t len)
+{
+    memcpy(buf, color_codes[type][color - C_BLACK], COLOR_CODE_SIZE);
+    memcpy(buf + COLOR_CODE_SIZE, data, len);
+    memcpy(buf + COLOR_CODE_SIZE + len, COLOR_RESET, COLOR_RESET_SIZE);
+    buf[COLOR_SIZE + len] = '\0';
+    return COLOR_SIZE + len;
+}
+
 void
 set_color(const Color color, const Color_type type)
 {
-    fprintf(stdout, COLOR_FORMAT, type, color);
+    fwrite(color_codes[type][color - C_BLACK], 1, COLOR_CODE_SIZE, stdout);
 }
 
 void
 clear_color(void)
 {
-    fprintf(stdout, "%s", COLOR_RESET);
+    fwrite(COLOR_RESET, 1, COLOR_RESET_SIZE, stdout);
 }
 
 char *
 color_string(const Color color, const Color_type type, const char *string)
 {
-    char *color_str;
-    char color_code[25];
+    size_t len = strlen(string);
+    char *color_str = xmalloc(len + COLOR_SIZE + 1);
 
-    sprintf(color_code, COLOR_FORMAT, type, color);
-    color_str = xmalloc(strlen(string) + strlen(color_code) + strlen(COLOR_RESET) + 1);
-    sprintf(color_str, "%s%s%s", color_code, string, COLOR_RESET);
+    color_append(color_str, color, type, string, len);
     return color_str;
 }
 
 char *
 color_num(const Color color, const Color_type type, const int num)
 {
-    char *color_str;
-    char color_code[25];
+    char digits[16];
+    int len = snprintf(digits, sizeof digits, "%d", num);
+    char *color_str = xmalloc(len + COLOR_SIZE + 1);
 
-    sprintf(color_code, COLOR_FORMAT, type, color);
-    color_str = xmalloc(strlen(color_code) + strlen(COLOR_RESET) + 10);
-    sprintf(color_str, "%s%d%s", color_code, num, COLOR_RESET);
+    color_append(color_str, color, type, digits, len);
     return color_str;
 }
 
 char *
 color_char(const Color color, const Color_type type, const char c)
 {
-    char *color_str;
-    char color_code[25];
+    char *color_str = xmalloc(COLOR_SIZE + 2);
 
-    sprintf(color_code, COLOR_FORMAT, type, color);
-    color_str = xmalloc(strlen(color_code) + strlen(COLOR_RESET) + 10);
-    sprintf(color_str, "%s%c%s", color_code, c, COLOR_RESET);
+    color_append(color_str, color, type, &c, 1);
     return color_str;
 }
 
+static int
+has_flag(const Flag *flag)
+{
+    return flag->flag != NULL || flag->function != NULL || flag->value != NULL;
+}
+
 static void
-ch_flag_short(char *arg, Flag *flags)
+set_flag(const Flag *flag)
+{
+    if (flag->flag != NULL)
+        *(flag->flag) = 1;
+
+    if (flag->function != NULL)
+        flag->function();
+}
+
+/* Returns the number of arguments used after arg. */
+static int
+ch_flag_short(char *arg, char *next, Flag *flags)
 {
     char c;
     
     while ((c = *arg++) != '\0') {
         int found = 0;
-        for (size_t i = 0; flags[i].flag != NULL || flags[i].function != NULL; ++i) {
+        for (size_t i = 0; has_flag(&flags[i]); ++i) {
             if (flags[i].ch != c)
                 continue;
 
-            if (flags[i].flag != NULL)
-                *(flags[i].flag) = 1;
-
-            if (flags[i].function != NULL)
-                flags[i].function();
+            set_flag(&flags[i]);
+
+            if (flags[i].value != NULL) {
+                if (*arg != '\0') {
+                    flags[i].value(arg);
+                    return 0;
+                }
+                if (next == NULL) {
+                    xerror("option requires an argument -- '%c'", c);
+                    exit(EXIT_FAILURE);
+                }
+                flags[i].value(next);
+                return 1;
+            }
 
             found = 1;
             break;
@@ -200,34 +427,49 @@ ch_flag_short(char *arg, Flag *flags)
             exit(EXIT_FAILURE);
         }
     }
+    return 0;
 }
 
-static void
-ch_flag_long(char *arg, Flag *flags)
+/* Returns the number of arguments used after arg. */
+static int
+ch_flag_long(char *arg, char *next, Flag *flags)
 {
-    size_t i;
-    int found = 0;
+    size_t i, len;
+    char *value;
 
-    for (i = 0; flags[i].flag != NULL || flags[i].function != NULL; ++i) {
-        if (flags[i].string == NULL || !streq(flags[i].string, arg))
-            continue;
+    value = strchr(arg, '=');
+    len = value ? (size_t)(value - arg) : strlen(arg);
 
-        if (flags[i].flag != NULL)
-            *(flags[i].flag) = 1;
+    for (i = 0; has_flag(&flags[i]); ++i) {
+        if (flags[i].string == NULL 
+        ||  strncmp(flags[i].string, arg, len) != 0 
+        ||  flags[i].string[len] != '\0')
+            continue;
 
-        if (flags[i].function != NULL)
-            flags[i].function();
+        set_flag(&flags[i]);
 
-        found = 1;
-        break;
+        if (flags[i].value == NULL) {
+            if (value != NULL) {
+                xerror("option '--%s' doesn't allow an argument", flags[i].string);
+                exit(EXIT_FAILURE);
+            }
+            return 0;
+        }
 
+        if (value != NULL) {
+            flags[i].value(value + 1);
+            return 0;
+        }
+        if (next == NULL) {
+            xerror("option '--%s' requires an argument", flags[i].string);
+            exit(EXIT_FAILURE);
+        }
+        flags[i].value(next);
+        return 1;
     }
 
-    if (!found)
-    {
-        xerror("invalid option -- '%s'", arg);
-        exit(EXIT_FAILURE);
-    }
+    xerror("invalid option -- '%s'", arg);
+    exit(EXIT_FAILURE);
 }
 
 char **
@@ -243,36 +485,118 @@ get_options(char **args, Flag *flags)
         }
 
         if (**args != '-') 
-            ch_flag_short(*args, flags);
+            args += ch_flag_short(*args, args[1], flags);
         else
-            ch_flag_long(++*args, flags);
+            args += ch_flag_long(++*args, args[1], flags);
     }
 
     no_flags[i] = NULL;
     return no_flags;
 }
 
+/* Powers of ten up to the largest one an unsigned long long holds. */
+static const unsigned long long powers_of_ten[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 
+    10000000000000000000ULL
+};
+
+/* Digits of 0 to 99, two characters each. */
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
 int 
-count_digits(int num)
+count_digits(unsigned long long num)
+{
+    /* Number of bits times log10(2) is either the number of digits 
+       or one less. Setting the lowest bit keeps 0 at one digit. */
+    int bits = 64 - __builtin_clzll(num | 1);
+    int digits = (bits * 1233 >> 12) + 1;
+
+    return digits - ((num | 1) < powers_of_ten[digits - 1]);
+}
+
+size_t
+format_num(char *buf, unsigned long long num)
 {
-    int digits = 0;
+    size_t len = count_digits(num);
+    char *p = buf + len;
+    unsigned int i;
+
+    *p = '\0';
+    while (num >= 100) {
+        i = (num % 100) * 2;
+        num /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
 
-    while (num > 0) {
-        num /= 10;
-        digits++;
+    if (num >= 10) {
+        *--p = digit_pairs[num * 2 + 1];
+        *--p = digit_pairs[num * 2];
+    } else {
+        *--p = '0' + num;
     }
-    return digits;
+    return len;
 }
 
+int
+size_scale(unsigned long long size)
+{
+    int scale = 0;
 
-char *
-num_to_str(const int num)
+    while (scale < SIZE_MAX_SCALE && size > 1ULL << 10 * (scale + 1))
+        scale++;
+    return scale;
+}
+
+size_t
+format_fixed(char *buf, unsigned long long num, int shift, int decimals)
 {
-    char *str;
+    unsigned long long mask = (1ULL << shift) - 1, whole = num >> shift;
+    unsigned long long rest = num & mask, half;
+    char frac[SIZE_MAX_DECIMALS];
+    size_t len;
+    int i, up;
+
+    /* Long division, one decimal at a time. rest stays below 
+       2^shift so multiplying by ten can't overflow. */
+    for (i = 0; i < decimals; ++i) {
+        rest *= 10;
+        frac[i] = rest >> shift;
+        rest &= mask;
+    }
+
+    /* Round half to even on what's left, as printf does. */
+    if (shift > 0 && rest != 0) {
+        half = 1ULL << (shift - 1);
+        if (rest != half)
+            up = rest > half;
+        else
+            up = (decimals > 0 ? frac[decimals - 1] : whole) & 1;
 
-    str = xmalloc(count_digits(num) + 1);
-    sprintf(str, "%d", num);
-    return str;
+        for (i = decimals; up && i-- > 0;) {
+            up = frac[i] == 9;
+            frac[i] = up ? 0 : frac[i] + 1;
+        }
+        whole += up;
+    }
+
+    len = format_num(buf, whole);
+    if (decimals > 0) {
+        buf[len++] = '.';
+        for (i = 0; i < decimals; ++i)
+            buf[len++] = '0' + frac[i];
+        buf[len] = '\0';
+    }
+    return len;
 }
 
 void
@@ -300,7 +624,9 @@ lusage(const char short_opt, const char *long_opt, const char *desc)
     if (long_opt != NULL) {
         set_color(C_GREEN, CT_LIGHT);
         fprintf(stdout, "--%s", long_opt);
-        spaces = 16 - strlen(long_opt);
+
+        /* Longer options still get a space before the text. */
+        spaces = strlen(long_opt) < 16 ? 16 - strlen(long_opt) : 1;
     }
     else
         spaces = 18;
@@ -314,6 +640,211 @@ lusage(const char short_opt, const char *long_opt, const char *desc)
     fputc('\n', stdout);
 }
 
+/* Write all of iov, retrying on short writes. */
+static void
+out_writev(struct iovec *iov, int count)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        if ((n = writev(STDOUT_FILENO, iov, count)) == -1) {
+            if (errno == EINTR)
+                continue;
+            errno = 0;
+            return;
+        }
+
+        for (; count > 0 && (size_t)n >= iov->iov_len; ++iov, --count)
+            n -= iov->iov_len;
+
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+void
+out_flush(void)
+{
+    struct iovec iov;
+
+    if (out_len == 0)
+        return;
+
+    iov.iov_base = out_buf;
+    iov.iov_len = out_len;
+    out_writev(&iov, 1);
+    out_len = 0;
+}
+
+void
+out_write(const char *data, size_t len)
+{
+    struct iovec iov[2];
+
+    if (len <= OUT_BUFFER_SIZE - out_len) {
+        memcpy(out_buf + out_len, data, len);
+        out_len += len;
+        return;
+    }
+
+    /* Too large to buffer, write it out along with the buffer. */
+    if (len >= OUT_BUFFER_SIZE) {
+        iov[0].iov_base = out_buf;
+        iov[0].iov_len = out_len;
+        iov[1].iov_base = (char *)data;
+        iov[1].iov_len = len;
+        out_writev(iov, 2);
+        out_len = 0;
+        return;
+    }
+
+    out_flush();
+    memcpy(out_buf, data, len);
+    out_len = len;
+}
+
+void
+out_puts(const char *str)
+{
+    out_write(str, strlen(str));
+}
+
+void
+out_char(const char c)
+{
+    if (out_len == OUT_BUFFER_SIZE)
+        out_flush();
+    out_buf[out_len++] = c;
+}
+
+void
+out_pad(size_t n)
+{
+    size_t len;
+
+    while (n > 0) {
+        if (out_len == OUT_BUFFER_SIZE)
+            out_flush();
+
+        len = OUT_BUFFER_SIZE - out_len;
+        if (len > n)
+            len = n;
+
+        memset(out_buf + out_len, ' ', len);
+        out_len += len;
+        n -= len;
+    }
+}
+
+void
+out_num(unsigned long num)
+{
+    char buf[NUM_SIZE];
+
+    out_write(buf, format_num(buf, num));
+}
+
+void
+out_color(const Color color, const Color_type type)
+{
+    out_write(color_codes[type][color - C_BLACK], COLOR_CODE_SIZE);
+}
+
+void
+out_reset(void)
+{
+    out_write(COLOR_RESET, COLOR_RESET_SIZE);
+}
+
+/* Length of the UTF-8 sequence at s, 0 if it isn't valid. Overlong
+   forms, surrogates and code points past U+10FFFF aren't. */
+static size_t
+utf8_length(const unsigned char *s)
+{
+    unsigned char lo, hi;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        return (s[1] & 0xc0) == 0x80 ? 2 : 0;
+
+    if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        lo = s[0] == 0xe0 ? 0xa0 : 0x80;
+        hi = s[0] == 0xed ? 0x9f : 0xbf;
+        return s[1] >= lo && s[1] <= hi && (s[2] & 0xc0) == 0x80 ? 3 : 0;
+    }
+
+    if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        lo = s[0] == 0xf0 ? 0x90 : 0x80;
+        hi = s[0] == 0xf4 ? 0x8f : 0xbf;
+        return s[1] >= lo && s[1] <= hi && (s[2] & 0xc0) == 0x80 
+            && (s[3] & 0xc0) == 0x80 ? 4 : 0;
+    }
+    return 0;
+}
+
+void
+out_json_string(const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *start;
+    unsigned char c;
+    size_t len;
+    char esc[6] = { '\\', 'u' };
+
+    out_char('"');
+    for (start = str; (c = *str) != '\0'; ++str) {
+        if (c >= 0x80 && (len = utf8_length((const unsigned char *)str)) > 0) {
+            str += len - 1;
+            continue;
+        }
+
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\')
+            continue;
+
+        /* Write the run before the character needing an escape. */
+        out_write(start, str - start);
+        start = str + 1;
+
+        if (c == '"' || c == '\\') {
+            out_char('\\');
+            out_char(c);
+            continue;
+        }
+
+        /* Control characters as themselves, stray bytes as the low
+           surrogate U+DC00 + byte, which no character is. */
+        esc[2] = c < 0x80 ? '0' : 'd';
+        esc[3] = c < 0x80 ? '0' : 'c';
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 0xf];
+        out_write(esc, 6);
+    }
+    out_write(start, str - start);
+    out_char('"');
+}
+
+void
+out_csv_field(const char *str)
+{
+    const char *quote;
+
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        out_puts(str);
+        return;
+    }
+
+    /* Quoted, with every '"' doubled. */
+    out_char('"');
+    while ((quote = strchr(str, '"')) != NULL) {
+        out_write(str, quote - str + 1);
+        out_char('"');
+        str = quote + 1;
+    }
+    out_puts(str);
+    out_char('"');
+}
+
 Xpasswd *
 get_passwd(uid_t uid)
 {
@@ -447,3 +978,348 @@ free_passwd(Xpasswd *xpwd)
     free(xpwd->shell);
     free(xpwd);
 }
+
+static size_t
+id_hash(unsigned long id, size_t size)
+{
+    return (id * 2654435761UL) & (size - 1);
+}
+
+static Id_entry *
+id_slot(Id_table *table, unsigned long id)
+{
+    size_t i;
+
+    for (i = id_hash(id, table->size); table->entries[i].name != NULL; i = (i + 1) & (table->size - 1)) {
+        if (table->entries[i].id == id)
+            break;
+    }
+    return &table->entries[i];
+}
+
+static void
+id_grow(Id_table *table)
+{
+    Id_entry *old = table->entries;
+    size_t i, old_size = table->size;
+
+    table->size = old_size ? old_size * 2 : 64;
+    table->entries = xmalloc(table->size * sizeof(Id_entry));
+
+    for (i = 0; i < table->size; ++i)
+        table->entries[i].name = NULL;
+
+    for (i = 0; i < old_size; ++i) {
+        if (old[i].name != NULL)
+            *id_slot(table, old[i].id) = old[i];
+    }
+    free(old);
+}
+
+/* Insert name for id, the first entry in the database wins
+   just like it does for get_passwd() and get_group(). */
+static void
+id_insert(Id_table *table, unsigned long id, const char *name, size_t len)
+{
+    Id_entry *slot;
+
+    if ((table->count + 1) * 2 > table->size)
+        id_grow(table);
+
+    slot = id_slot(table, id);
+    if (slot->name != NULL)
+        return;
+
+    slot->id = id;
+    slot->name = xmalloc(len + 1);
+    memcpy(slot->name, name, len);
+    slot->name[len] = '\0';
+    table->count++;
+}
+
+/* Read name:password:id from every line in the database. */
+static void
+id_load(Id_table *table)
+{
+    char line[1024], *name_end, *id_start, *id_end;
+    unsigned long id;
+    FILE *fp;
+
+    table->loaded = 1;
+    id_grow(table);
+
+    if ((fp = fopen(table->path, "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(fp)) {
+            int c;
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                ;
+        }
+
+        if ((name_end = strchr(line, ':')) == NULL)
+            continue;
+
+        if ((id_start = strchr(name_end + 1, ':')) == NULL)
+            continue;
+
+        ++id_start;
+        id = strtoul(id_start, &id_end, 10);
+        if (id_end == id_start || (*id_end != ':' && *id_end != '\n' && *id_end != '\0'))
+            continue;
+
+        id_insert(table, id, line, name_end - line);
+    }
+    fclose(fp);
+}
+
+static int
+id_source_get(const char *path, Id_source *src)
+{
+    struct stat st;
+
+    memset(src, 0, sizeof(Id_source));
+
+    if (stat(path, &st) == -1) {
+        errno = 0;
+        return 0;
+    }
+
+    src->dev = st.st_dev;
+    src->ino = st.st_ino;
+    src->mtime_sec = st.st_mtim.tv_sec;
+    src->mtime_nsec = st.st_mtim.tv_nsec;
+    src->size = st.st_size;
+    return 1;
+}
+
+static char *
+id_index_path(void)
+{
+    char *home, *path;
+
+    if ((home = getenv("HOME")) == NULL || *home == '\0')
+        return NULL;
+
+    path = xmalloc(strlen(home) + strlen(ID_INDEX_FILE) + 2);
+    sprintf(path, "%s/%s", home, ID_INDEX_FILE);
+    return path;
+}
+
+static int
+id_index_map(const char *path, const Id_source *passwd, const Id_source *group)
+{
+    const Id_index_header *header;
+    struct stat st;
+    size_t entries_size;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return 0;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Id_index_header)) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    header = map;
+    entries_size = ((size_t)header->num_users + header->num_groups) * sizeof(Id_index_entry);
+
+    if (header->magic != ID_INDEX_MAGIC || header->version != ID_INDEX_VERSION
+    ||  memcmp(&header->passwd, passwd, sizeof(Id_source)) != 0
+    ||  memcmp(&header->group, group, sizeof(Id_source)) != 0
+    ||  header->heap_size == 0
+    ||  sizeof(Id_index_header) + entries_size + header->heap_size != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    index_users.entries = (const Id_index_entry *)(header + 1);
+    index_users.count = header->num_users;
+    index_groups.entries = index_users.entries + header->num_users;
+    index_groups.count = header->num_groups;
+    index_heap = (const char *)(index_groups.entries + header->num_groups);
+    index_heap_size = header->heap_size;
+
+    /* Make sure every name in the heap is terminated. */
+    if (index_heap[index_heap_size - 1] != '\0') {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+id_entry_cmp(const void *v1, const void *v2)
+{
+    const Id_index_entry *e1 = v1, *e2 = v2;
+
+    return (e1->id > e2->id) - (e1->id < e2->id);
+}
+
+/* Append the entries of table to entries and their names to heap. */
+static size_t
+id_index_fill(Id_table *table, Id_index_entry *entries, char *heap, size_t *heap_size)
+{
+    size_t i, len, count = 0;
+
+    for (i = 0; i < table->size; ++i) {
+        if (table->entries[i].name == NULL || table->entries[i].id > UINT32_MAX)
+            continue;
+
+        len = strlen(table->entries[i].name) + 1;
+        entries[count].id = table->entries[i].id;
+        entries[count].name = *heap_size;
+        memcpy(heap + *heap_size, table->entries[i].name, len);
+        *heap_size += len;
+        count++;
+    }
+    qsort(entries, count, sizeof(Id_index_entry), id_entry_cmp);
+    return count;
+}
+
+/* Write both tables to a temporary file and move it in place,
+   concurrent readers either see the old or the new index. */
+static void
+id_index_write(const char *path, const Id_source *passwd, const Id_source *group)
+{
+    Id_index_header header;
+    Id_index_entry *entries;
+    char *heap, *tmp, *slash;
+    size_t i, heap_size = 0, num_entries = passwd_table.count + group_table.count;
+    int fd;
+
+    entries = xmalloc((num_entries + 1) * sizeof(Id_index_entry));
+    heap_size = 1;
+    for (i = 0; i < passwd_table.size; ++i)
+        if (passwd_table.entries[i].name) heap_size += strlen(passwd_table.entries[i].name) + 1;
+    for (i = 0; i < group_table.size; ++i)
+        if (group_table.entries[i].name) heap_size += strlen(group_table.entries[i].name) + 1;
+
+    heap = xmalloc(heap_size);
+    heap[0] = '\0';
+    heap_size = 1;
+
+    memset(&header, 0, sizeof header);
+    header.magic = ID_INDEX_MAGIC;
+    header.version = ID_INDEX_VERSION;
+    header.passwd = *passwd;
+    header.group = *group;
+    header.num_users = id_index_fill(&passwd_table, entries, heap, &heap_size);
+    header.num_groups = id_index_fill(&group_table, entries + header.num_users, heap, &heap_size);
+    header.heap_size = heap_size;
+    num_entries = header.num_users + header.num_groups;
+
+    tmp = xmalloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    /* Create ~/.xutils if the installer hasn't. */
+    slash = strrchr(tmp, '/');
+    *slash = '\0';
+    mkdir(tmp, 0755);
+    *slash = '/';
+
+    if ((fd = mkstemp(tmp)) != -1) {
+        if (write(fd, &header, sizeof header) != sizeof header
+        ||  write(fd, entries, num_entries * sizeof(Id_index_entry)) != (ssize_t)(num_entries * sizeof(Id_index_entry))
+        ||  write(fd, heap, heap_size) != (ssize_t)heap_size
+        ||  fchmod(fd, 0644) == -1
+        ||  close(fd) == -1
+        ||  rename(tmp, path) == -1)
+            unlink(tmp);
+    }
+
+    errno = 0;
+    free(tmp);
+    free(heap);
+    free(entries);
+}
+
+/* Map the index, rebuilding it if either database changed. */
+static void
+id_index_open(void)
+{
+    Id_source passwd, group;
+    char *path;
+
+    id_index_checked = 1;
+
+    if ((path = id_index_path()) == NULL)
+        return;
+
+    if (!id_source_get(passwd_table.path, &passwd) || !id_source_get(group_table.path, &group)) {
+        free(path);
+        return;
+    }
+
+    if (!id_index_map(path, &passwd, &group)) {
+        if (!passwd_table.loaded)
+            id_load(&passwd_table);
+        if (!group_table.loaded)
+            id_load(&group_table);
+
+        id_index_write(path, &passwd, &group);
+        free(path);
+        return;
+    }
+
+    id_index_valid = 1;
+    free(path);
+}
+
+static const char *
+id_index_find(const Id_index_table *table, unsigned long id)
+{
+    size_t low = 0, high = table->count, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+
+        if (table->entries[mid].id == id) {
+            if (table->entries[mid].name >= index_heap_size)
+                return NULL;
+            return index_heap + table->entries[mid].name;
+        }
+
+        if (table->entries[mid].id < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+static const char *
+id_lookup(Id_table *table, unsigned long id)
+{
+    if (!id_index_checked)
+        id_index_open();
+
+    if (id_index_valid)
+        return id_index_find(table == &passwd_table ? &index_users : &index_groups, id);
+
+    if (!table->loaded)
+        id_load(table);
+
+    return id_slot(table, id)->name;
+}
+
+const char *
+user_name(uid_t uid)
+{
+    return id_lookup(&passwd_table, uid);
+}
+
+const char *
+group_name(gid_t gid)
+{
+    return id_lookup(&group_table, gid);
+}
@@ -48,16 +48,36 @@ typedef enum {
     CT_DARK
 } Color_type;
 
+typedef struct arena_block Arena_block;
+
+/* Bump allocator, everything allocated from an arena is
+   released at once by arena_free(). */
+typedef struct {
+    Arena_block *blocks;
+
+    /* Size of the next block, doubles up to ARENA_MAX_BLOCK. */
+    size_t block_size;
+} Arena;
+
 typedef void (*Function)(void);
+typedef void (*Value_function)(const char *);
 typedef unsigned short int Option;
 
-#define COLOR_SIZE 11
+/* Length of an escape sequence setting a color, of the one
+   resetting it and of both around a colored string. */
+#define COLOR_CODE_SIZE 7
+#define COLOR_RESET_SIZE 4
+#define COLOR_SIZE (COLOR_CODE_SIZE + COLOR_RESET_SIZE)
 
 typedef struct {
     char *string;
     char ch;
     Option *flag;
     Function function;
+
+    /* Set for options taking a value, given as -x VALUE, -xVALUE,
+       --string=VALUE or --string VALUE. */
+    Value_function value;
 } Flag;
 
 extern char **get_options(char ** /* args */, Flag * /* flag */);
@@ -67,20 +87,84 @@ extern void xerror(const char * /* format */, ...);
 extern void *xmalloc(size_t /* size */);
 extern void *xrealloc(void * /* p */, size_t /* size */);
 
+extern void arena_init(Arena * /* arena */);
+extern void *arena_alloc(Arena * /* arena */, size_t /* size */);
+extern char *arena_strdup(Arena * /* arena */, const char * /* string */);
+extern void arena_free(Arena * /* arena */);
+
 extern char *dupstr(const char * /* string */);
 extern int streq(const char * /* str1 */, const char * /* str2 */);
-extern char *num_to_str(const int /* number */);
-extern int count_digits(int /* number */);
+
+/* Number of decimal digits in number, 1 for 0. */
+extern int count_digits(unsigned long long /* number */);
+
+/* Buffer size that holds any number written by format_num(). */
+#define NUM_SIZE 21
+
+/* Writes number in decimal to buf, '\0' terminated. Returns the length. */
+extern size_t format_num(char * /* buf */, unsigned long long /* number */);
+
+/* Largest scale returned by size_scale() and largest number of
+   decimals format_fixed() handles. */
+#define SIZE_MAX_SCALE 6
+#define SIZE_MAX_DECIMALS 8
+
+/* Number of times size has to be divided by 1024 to get it at or 
+   below 1024, at most SIZE_MAX_SCALE. */
+extern int size_scale(unsigned long long /* size */);
+
+/* Writes number / 2^shift with decimals digits after the point to buf,
+   rounded half to even like printf("%.*f"). shift is at most 60,
+   buf must hold NUM_SIZE + decimals + 1 bytes. Returns the length. */
+extern size_t format_fixed(char * /* buf */, unsigned long long /* number */, int /* shift */, int /* decimals */);
+
 extern void free_array(char ** /* array */, const size_t /* size */);
 extern char *color_string(const Color /* color */, const Color_type /* type */, const char * /* string */);
 extern char *color_num(const Color /* color */, const Color_type /* type */, const int /* number */);
 extern char *color_char(const Color /* color */, const Color_type /* type */, const char /* character */);
+
+/* Escape sequence for color, COLOR_CODE_SIZE bytes long. */
+extern const char *color_code(const Color /* color */, const Color_type /* type */);
+
+/* Writes len bytes of data wrapped in the escape sequences for color
+   to buf, which must hold len + COLOR_SIZE + 1 bytes. Returns the 
+   number of bytes written, not counting the terminating '\0'. */
+extern size_t color_append(char * /* buf */, const Color /* color */, const Color_type /* type */, const char * /* data */, size_t /* len */);
+
 extern void set_color(const Color /* color */, const Color_type /* type */);
 extern void clear_color(void);
 
+/* Buffered output to stdout, written with write()/writev() once 
+   the buffer fills up or out_flush() is called. Don't mix with
+   stdio on stdout without flushing first. */
+extern void out_write(const char * /* data */, size_t /* len */);
+extern void out_puts(const char * /* string */);
+extern void out_char(const char /* character */);
+extern void out_pad(size_t /* spaces */);
+extern void out_num(unsigned long /* number */);
+extern void out_color(const Color /* color */, const Color_type /* type */);
+extern void out_reset(void);
+
+/* Writes string as a quoted JSON string, escaping '"', '\\' and control
+   characters. Bytes that aren't part of valid UTF-8 are written as
+   \udc80 to \udcff, like Python's surrogateescape. */
+extern void out_json_string(const char * /* string */);
+
+/* Writes string as a CSV field, quoted when it holds a ',', '"' or a line 
+   break. */
+extern void out_csv_field(const char * /* string */);
+
+extern void out_flush(void);
+
 extern Xpasswd *get_passwd(uid_t /* uid */);
 extern Xgroup *get_group(gid_t /* gid */);
 
+/* Cached lookups, /etc/passwd and /etc/group are read at most once
+   per process and indexed in ~/.xutils/idindex for later runs.
+   Returns NULL if the id has no entry. */
+extern const char *user_name(uid_t /* uid */);
+extern const char *group_name(gid_t /* gid */);
+
 extern void xversion(const char * /* program_name */, const char * /* version */, const char * /* copyright */, const char * /* description */);
 extern void lusage(const char /* short_flag */, const char * /* long_flag */, const char * /* message */);
 extern void author(void);
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
+#include <locale.h>
+#include <pthread.h>
 
 #include <pwd.h>
 #include <grp.h>
@@ -13,6 +19,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#endif
+
 #define PROGRAM_NAME "ls"
 #define VERSION "1.1"
 #define AUTHOR "niels@n-ve.be"
@@ -20,6 +33,7 @@
 
 #include "xlib.h"
 
+#ifndef DT_UNKNOWN
 enum {
     DT_UNKNOWN = 0,
     DT_FIFO = 1,
@@ -31,6 +45,7 @@ enum {
     DT_SOCK = 12,
     DT_WHT = 14
 };
+#endif
 
 typedef enum {
     /* Block device. */
@@ -68,26 +83,36 @@ struct file_data
     /* Filename. */
     char *name;
 
-    /* File mode as a string, type - permissions. */
-    char **mode;
+    /* File type and permission bits. */
+    mode_t mode;
 
     /* User who owns the file. */
-    char *user;
+    const char *user;
+    uid_t uid;
 
     /* Group that owns the file. */
-    char *group;
+    const char *group;
+    gid_t gid;
 
     /* Number of links. */
     int nlink;
 
+    /* Inode number, kept for --dump. */
+    ino_t ino;
+
     /* Filesize in bytes. */
     long fsize;
 
+    /* Allocated 512 byte blocks, kept for --du. */
+    long blocks;
+
     /* Filetype (see enum filetype) */
     Filetype type;
 
-    /* Time last modified. */
-    char *mtime;
+    /* Time selected with --time, and formatted for -l. */
+    time_t time;
+    long time_nsec;
+    const char *time_str;
 
     /* Length of the filename. */
     size_t nlen;
@@ -98,8 +123,22 @@ struct file_data
 
 typedef struct file_data File_data;
 
+typedef struct dir_data Dir_data;
+
+typedef struct slot Slot;
+
+/* File with more than one link in a directory listed by --du. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t apparent, allocated;
+} Du_link;
+
 struct dir_data 
 {
+    /* Holds the files, their strings and path. */
+    Arena arena;
+
     /* Full path to this directory. */
     char *path;
 
@@ -109,39 +148,395 @@ struct dir_data
     /* Size of files. */
     size_t num_files;
 
+    /* Allocated size of files. */
+    size_t files_size;
+
     /* Maximum length of each type to order the columns
        when long format is set. */
     size_t luser, lgroup, lnlink, lfsize, lname;
 
-    /* Number of rows when displaying the files horizontally. */
+    /* Length of the shortest name, for the column layout. */
+    size_t sname;
+
+    /* Number of rows when displaying the files in columns. */
     size_t num_rows;
  
-    /* Number of columns when displaying the files horizontally. */
+    /* Number of columns when displaying the files in columns. */
     size_t num_cols;
 
-    /* Columns for displaying horizontally .*/
-    File_data ***columns;
+    /* Width of each column, owned by layout_columns() and valid 
+       until the next directory is laid out. */
+    size_t *col_widths;
+
+    /* Subdirectories to list with -R, in the order they were read. */
+    Slot **subdirs;
+    size_t num_subdirs;
 
-    /* Maximum width per column */
-    size_t *max_per_col;
+    /* Names of subdirs, only until they're handed to a worker. */
+    char **sub_names;
 
-    /* Current row when printing. */
-    size_t current_row;
+    /* Cached listing the file names point into (--cache). */
+    void *map;
+    size_t map_size;
 
-    /* Current col when printing. */
-    size_t current_col;
+    /* Set when only part of the directory could be listed. */
+    int failed;
 
-    /* Current file to print. */
-    size_t current_file;
+    /* Apparent and allocated size of the directory and the files
+       in it with one link, without subdirectories (--du). Files with
+       more links are left to the printer, which tells which one is 
+       seen first. dev and ino are those of the directory. */
+    uint64_t apparent, allocated;
+    Du_link *links;
+    size_t num_links;
+    uint64_t dev, ino;
 };
 
-typedef struct dir_data Dir_data;
+/* Result of reading a directory, filled in by a worker and 
+   consumed by the printer. */
+struct slot
+{
+    /* NULL if the directory couldn't be read. */
+    Dir_data *dir;
+
+    /* Set once a worker took the task reading it, and once dir has
+       been stored. */
+    int taken;
+    int done;
+
+    /* Set for directories given on the command line. */
+    int root;
+};
+
+/* Entry handed out by a Dir_reader. name points into the reader
+   and is only valid until the next call to reader_next(). */
+typedef struct {
+    const char *name;
+    unsigned char type;
+} Dir_entry;
+
+typedef struct {
+    /* readdir() backend. */
+    DIR *d;
+
+    /* getdents64 backend, records are parsed in place. */
+    int fd;
+    char *buf;
+    size_t buf_size;
+    size_t pos;
+    size_t len;
+} Dir_reader;
+
+#ifdef __linux__
+/* Record layout returned by the getdents64 system call. */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/* Default buffer size for --getdents. */
+#define DIR_BUFFER_SIZE (1024 * 1024)
+
+#ifdef __linux__
+/* io_uring used to stat the entries of a directory in batches. */
+typedef struct {
+    int fd;
+    unsigned int depth;
+
+    /* Set when statx isn't supported by the ring. */
+    int broken;
+
+    /* Submission queue. */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue. */
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+} Stat_ring;
+#endif
+
+/* Default number of statx requests in flight with --io-uring. */
+#define QUEUE_DEPTH 256
+
+/* Entries stat'ed per batch with --io-uring. */
+#define STAT_BATCH 4096
+
+/* Directory fd shared by the tasks for its subdirectories,
+   closed once every one of them has been opened. */
+typedef struct {
+    Dir_reader reader;
+    size_t refs;
+} Dir_ref;
+
+/* Directory waiting to be read by a worker. */
+typedef struct {
+    /* Directory name is relative to, NULL for AT_FDCWD. */
+    Dir_ref *parent;
+    char *name;
+
+    /* Path to print. */
+    char *path;
+
+    /* Where to store the result. */
+    Slot *slot;
+} Task;
+
+/* Tasks owned by one worker. The owner pushes and pops at the
+   tail, idle workers steal from the head. */
+typedef struct {
+    pthread_mutex_t lock;
+    Task **tasks;
+    size_t head, tail, size;
+} Deque;
+
+typedef struct {
+    pthread_t thread;
+    size_t id;
+    Deque deque;
+} Worker;
+
+/* Timestamps to show and sort on. */
+typedef enum {
+    TIME_MTIME,
+    TIME_CTIME,
+    TIME_ATIME
+} Time_type;
+
+/* Ways to print the files, anything but FORMAT_TEXT is meant for
+   other programs and has no colours, padding or headers. */
+typedef enum {
+    FORMAT_TEXT,
+
+    /* One JSON object per line (--format=json). */
+    FORMAT_JSON,
+
+    /* Comma separated values with a header line (--format=csv). */
+    FORMAT_CSV,
 
-/* Directories to list. */
-static Dir_data **dirs = NULL;
+    /* Names terminated by '\0' (-0). */
+    FORMAT_NUL
+} Output_format;
 
-/* Total number of directories. */
-static size_t num_dirs = 0;
+/* Binary listing written by --dump and read by --load. The header
+   is followed by a column per field, each an array with an entry per 
+   file, the directory table and a string heap with the names and 
+   paths. Sections start at 8 byte aligned offsets so the file can be 
+   mapped and the columns used in place. */
+#define DUMP_MAGIC   0x44534c58 /* "XLSD" */
+#define DUMP_VERSION 3
+
+#define DUMP_RECURSIVE 0x1
+
+typedef enum {
+    /* uint64_t inode number. */
+    COL_INO,
+
+    /* uint32_t st_mode, uid and gid. */
+    COL_MODE,
+    COL_UID,
+    COL_GID,
+
+    /* int64_t size in bytes and allocated 512 byte blocks. */
+    COL_SIZE,
+    COL_BLOCKS,
+
+    /* int64_t seconds and uint32_t nanoseconds of the time given by
+       the time_type in the header, mtime unless --time was used. */
+    COL_TIME,
+    COL_TIME_NSEC,
+
+    /* uint32_t number of links. */
+    COL_NLINK,
+
+    /* uint64_t offset of the name in the heap. */
+    COL_NAME,
+
+    /* uint8_t Filetype. */
+    COL_TYPE,
+
+    NUM_COLUMNS
+} Dump_column;
+
+/* Identity of a directory cached with --cache. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+} Dump_source;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_files;
+    uint64_t num_dirs;
+
+    /* Time_type of COL_TIME. */
+    uint32_t time_type;
+
+    /* DUMP_RECURSIVE if listed with -R. */
+    uint32_t flags;
+
+    /* Offsets from the start of the file. */
+    uint64_t columns[NUM_COLUMNS];
+    uint64_t dirs;
+    uint64_t heap;
+    uint64_t heap_size;
+
+    /* Size of the whole file. */
+    uint64_t size;
+
+    /* For --cache, the directory listed, a hash of the options that
+       decide on what's listed, see cache_init(), and when it was 
+       written. Zero in files written by --dump. */
+    Dump_source source;
+    uint64_t options;
+    int64_t written;
+} Dump_header;
+
+/* A directory, its files are the count entries from first on in 
+   the order they were listed. */
+typedef struct {
+    /* Offset of the path in the heap. */
+    uint64_t path;
+    uint64_t first;
+    uint64_t count;
+} Dump_dir;
+
+/* Dump being written. Sections are spooled to temporary files and
+   put together by dump_finish(), so memory use doesn't depend on 
+   the number of files. */
+typedef struct {
+    char *path;
+    FILE *columns[NUM_COLUMNS];
+    FILE *dirs;
+    FILE *heap;
+    uint64_t num_files;
+    uint64_t num_dirs;
+    uint64_t heap_size;
+    int failed;
+} Dump_writer;
+
+/* Mapped dump for --load. */
+typedef struct {
+    void *map;
+    size_t size;
+    const Dump_header *header;
+    const char *columns[NUM_COLUMNS];
+    const Dump_dir *dirs;
+    const char *heap;
+} Dump;
+
+/* Number of columns tried by layout_columns(), with the files 
+   filled in column by column in rows entries each. */
+typedef struct {
+    size_t num_cols;
+    size_t rows;
+
+    /* File that starts the next column, and the width of the 
+       current one. */
+    size_t next;
+    size_t width;
+
+    /* Sum of the widths of the columns before the current one, each
+       plus a space. */
+    size_t line_len;
+
+    /* Widths of the columns before the current one. */
+    size_t *widths;
+    size_t cols;
+} Column_fit;
+
+/* Size of a formatted time. */
+#define TIME_SIZE 128
+
+/* Files older than this, or from the future, show their year. */
+#define SIX_MONTHS (31556952 / 2)
+
+/* Minutes kept by format_time(), a power of two. */
+#define TIME_CACHE_SIZE 256
+
+/* Broken-down time of a minute, and its formatted strings for files 
+   from the past six months and the others. */
+typedef struct {
+    int valid;
+    time_t minute;
+    struct tm tm;
+    char str[2][TIME_SIZE];
+    size_t len[2];
+} Time_cache;
+
+/* Permission bits covered by the mode table. */
+#define MODE_TABLE_SIZE 010000
+
+/* Text and octal digits of the permission bits of a mode, the 
+   digits index the colour tables. */
+typedef struct {
+    char text[9];
+    unsigned char digits[3];
+} Mode_entry;
+
+/* Orders to sort the files in. */
+typedef enum {
+    SORT_NAME,
+    SORT_TIME,
+    SORT_SIZE,
+    SORT_EXTENSION,
+    SORT_VERSION
+} Sort_type;
+
+/* Sort key computed once per file. key is either the first bytes
+   of the name or extension, or a number, idx is the position of
+   the file before sorting. */
+typedef struct {
+    uint64_t key;
+    const char *name;
+    size_t idx;
+} Sort_key;
+
+typedef int (*Compare_function)(const void *, const void *);
+
+/* Part of a parallel sort, either sorting n keys or merging the 
+   runs keys[0..n1) and keys[n1..n) into tmp. */
+typedef struct {
+    Sort_key *keys;
+    Sort_key *tmp;
+    size_t n, n1;
+    pthread_t thread;
+} Sort_job;
+
+/* Keys per thread below which a sort stays on one thread. */
+#define SORT_PARALLEL_MIN (64 * 1024)
+
+/* Maximum number of threads for one sort. */
+#define SORT_MAX_THREADS 64
+
+/* Line width when the terminal doesn't tell. */
+#define DEFAULT_WIDTH 80
+
+/* Maximum for -j. */
+#define MAX_JOBS 256
+
+/* Entries read, stat'ed and printed at a time with -U. */
+#define UNSORTED_CHUNK 256
+
+/* Fixed field widths for long listings with -U. */
+#define UNSORTED_NLINK 3
+#define UNSORTED_USER  8
+#define UNSORTED_SIZE  8
+
+/* Read directories that may wait for the printer, per job. */
+#define READY_PER_JOB 16
 
 /* Filetypes to ignore if specified. */
 enum {
@@ -162,6 +557,43 @@ enum {
 /* File types to ignore when listing. */
 static int ignore_files = I_HIDDEN;
 
+/* Kinds of compiled shell patterns. */
+typedef enum {
+    /* No wildcards. */
+    PAT_LITERAL,
+
+    /* A literal followed by '*'. */
+    PAT_PREFIX,
+
+    /* '*' followed by a literal. */
+    PAT_SUFFIX,
+
+    /* A literal between '*'s. */
+    PAT_INFIX,
+
+    /* Anything else. */
+    PAT_GLOB
+} Pattern_type;
+
+typedef struct {
+    Pattern_type type;
+
+    /* The whole pattern. */
+    const char *text;
+
+    /* The literal part for the fast paths. */
+    const char *literal;
+    size_t len;
+} Pattern;
+
+/* Entries matching any of these are not listed (-I). */
+static Pattern *ignore_patterns = NULL;
+static size_t num_ignore = 0;
+
+/* Same, unless -a or -A is given (--hide). */
+static Pattern *hide_patterns = NULL;
+static size_t num_hide = 0;
+
 /* Print the files on a new line. */
 static int print_file_nl = 0;
 
@@ -199,6 +631,186 @@ static Option f_human_readable = 0;
 
 static Option f_no_classify = 0;
 
+/* List entries in directory order as they're read, without 
+   keeping them around. */
+static Option f_unsorted = 0;
+
+/* Order to list the files in. */
+static Sort_type sort_type = SORT_NAME;
+
+/* --format and -0. */
+static Output_format output_format = FORMAT_TEXT;
+
+/* Write the listing to this file instead of printing it (--dump). */
+static const char *dump_path = NULL;
+static Dump_writer dump_writer;
+
+/* Print the listing in this dump instead of reading directories 
+   (--load). */
+static const char *load_path = NULL;
+
+/* Keep the listing of every directory read in cache_dir and reuse
+   it while the directory is unchanged (--cache). */
+static Option f_cache = 0;
+static char *cache_dir = NULL;
+
+/* Seconds a cached listing stays valid after changes to the 
+   directory's metadata alone, which don't touch its mtime. */
+static long cache_ttl = 0;
+
+/* Hash of the options a cached listing depends on. */
+static uint64_t cache_options = 0;
+
+/* Print the apparent and allocated size of every directory, 
+   including everything below it, instead of the files (--du). With
+   --total-size only the directories given on the command line. */
+static Option f_du = 0;
+static Option f_total_size = 0;
+
+/* Device and inode of a file. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} File_id;
+
+/* Open addressed set of File_id, inode 0 marks a free entry. */
+typedef struct {
+    File_id *ids;
+    size_t size;
+    size_t count;
+} Id_set;
+
+/* Files with more than one link counted below the command line 
+   argument being added up. */
+static Id_set arg_links;
+
+/* Directories and files with more than one link counted for the 
+   total, which is only printed for more than one argument. An 
+   argument below another isn't counted again. */
+static int du_total = 0;
+static Id_set total_dirs;
+static Id_set total_links;
+
+/* Directory of --du whose subdirectories are still being added
+   up. The printer keeps one for every level it's below a 
+   command line argument. */
+typedef struct {
+    char *path;
+    uint64_t apparent, allocated;
+
+    /* Part not counted under an earlier argument, for the total. */
+    uint64_t total_apparent, total_allocated;
+
+    /* Subdirectories not added yet. */
+    size_t left;
+    int root;
+} Du_node;
+
+static Du_node *du_stack = NULL;
+static size_t du_len = 0;
+static size_t du_size = 0;
+
+/* Sum of the command line arguments. */
+static uint64_t du_apparent = 0;
+static uint64_t du_allocated = 0;
+
+/* Flags to stat files with, --du counts links themselves. */
+static int stat_flags = 0;
+
+/* Names of the file types in records, indexed by Filetype. Whether 
+   a file is executable shows in its mode. */
+static const char *type_names[] = {
+    "block", "char", "dir", "fifo", "link", "file", 
+    "socket", "whiteout", "file", "unknown"
+};
+
+/* Timestamp to show and sort on (--time). */
+static Time_type time_type = TIME_MTIME;
+
+/* strftime() formats for old files and recent ones (--time-style),
+   %N gives the nanoseconds. */
+static const char *time_formats[2] = { "%b %e  %Y", "%b %e %H:%M" };
+
+/* Set when the formats don't go below minutes, so the strings 
+   can be cached per minute. */
+static int time_by_minute = 1;
+
+/* Time at startup, to tell recent files. */
+static time_t now;
+
+/* Per worker, so no locking is needed. Indexed by the number of 
+   the minute, so the minutes of clustered times each get their 
+   own entry whatever order the files come in. */
+static __thread Time_cache time_cache[TIME_CACHE_SIZE];
+
+/* Indexed by st_mode & 07777, see init_mode_table(). */
+static Mode_entry mode_table[MODE_TABLE_SIZE];
+
+/* Reverse the order while sorting. */
+static Option f_reverse = 0;
+
+/* Sort names in the collation order of the locale. */
+static Option f_collate = 0;
+
+/* Print a header for every directory with -U, where we can't wait
+   to see how many directories there are. */
+static int unsorted_headers = 0;
+
+/* Read directories with getdents64 instead of readdir(). */
+static Option f_getdents = 0;
+
+/* Buffer size in bytes for f_getdents. */
+static size_t dir_buffer_size = DIR_BUFFER_SIZE;
+
+/* Stat entries through io_uring when available. */
+static Option f_io_uring = 0;
+
+/* Requests in flight for f_io_uring. */
+static unsigned int queue_depth = QUEUE_DEPTH;
+
+/* Number of threads reading directories. */
+static size_t num_jobs = 1;
+
+static Worker *workers;
+
+/* Guards pending and queued. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* Tasks not finished yet and tasks sitting in a deque. */
+static size_t pending = 0;
+static size_t queued = 0;
+
+/* Directories read but not printed yet, also guarded by pool_lock. */
+static size_t ready = 0;
+
+/* Directories waiting to be printed, the next one on top. Only
+   the first worker touches these. */
+static Slot **print_stack = NULL;
+static size_t print_len = 0;
+static size_t print_size = 0;
+
+/* The first directory is held back until we know whether 
+   there's more than one, which decides on the headers. */
+static Dir_data *held_dir = NULL;
+
+/* Layouts tried by layout_columns() and their column widths. Kept
+   for the next directory, only the printer lays out columns. */
+static Column_fit *column_fits = NULL;
+static size_t *column_widths = NULL;
+static size_t max_fits = 0;
+static size_t num_printed = 0;
+
+static int exit_status = EXIT_SUCCESS;
+
+/* Exit with the worst of the problems seen. */
+static void
+set_exit_status(int status)
+{
+    if (status > exit_status)
+        exit_status = status;
+}
+
 static void
 version(void)
 {
@@ -236,11 +848,37 @@ usage(void)
     lusage('h', "human-readable",  "with -l, print sizes in human readable format");
     lusage('i', "inode",           "print the index number of each file");
     lusage('I', "ignore=PATTERN",  "do not list implied entries matching shell PATTERN");
+    lusage( 0,  "hide=PATTERN",    "do not list implied entries matching shell PATTERN (overridden by -a or -A)");
     lusage('l', NULL,              "use a long format.");
     lusage('m', NULL,              "fill width with a comma separated list of entries");
     lusage('n', "numeric-uid-gid", "with -l, numeric user and group IDs");
     lusage('r', "reverse",         "reverse order while sorting");
     lusage('R', "recursive",       "list subdirectories recursively");
+    lusage('S', NULL,              "sort by file size, largest first");
+    lusage('t', NULL,              "sort by time, newest first");
+    lusage('v', NULL,              "natural sort of (version) numbers within text");
+    lusage('X', NULL,              "sort alphabetically by entry extension");
+    lusage( 0,  "sort=WORD",       "sort by WORD: none, name, time, size, extension, version");
+    lusage( 0,  "collate",         "sort names in the collation order of the locale");
+    lusage( 0,  "time=WORD",       "show and sort on WORD: mtime (default), ctime, atime");
+    lusage( 0,  "time-style=STYLE", "with -l, show times as full-iso, long-iso, iso, locale or +FORMAT");
+    lusage( 0,  "format=WORD",     "print a record per file: json (one object per line), csv");
+    lusage( 0,  NULL,              "in json, bytes of names that aren't UTF-8 are written as \\udc80 to \\udcff");
+    lusage('0', "zero",            "end each name with NUL instead of newline");
+    lusage( 0,  "dump=FILE",       "write the listing to FILE in binary instead of printing it");
+    lusage( 0,  "load=FILE",       "print the listing in FILE, written by --dump");
+    lusage( 0,  "cache",           "reuse listings of unchanged directories, kept in ~/.xutils/lscache");
+    lusage( 0,  NULL,              "a listing is reused until an entry is added, removed or renamed, so sizes and times of files written since may be old");
+    lusage( 0,  "cache-ttl=SECONDS", "with --cache, keep using a listing this long after the directory's metadata changed (default 0)");
+    lusage( 0,  "du",              "print the apparent and allocated size of every directory below each FILE");
+    lusage( 0,  "total-size",      "print the apparent and allocated size of each FILE only");
+    lusage('U', NULL,              "do not sort; list entries in directory order");
+    lusage('f', NULL,              "do not sort, enable -a");
+    lusage('j', "jobs=N",          "read directories with N threads");
+    lusage( 0,  "getdents",        "read directories with getdents64 instead of readdir");
+    lusage( 0,  "dir-buffer=SIZE", "with --getdents, buffer size (default 1M)");
+    lusage( 0,  "io-uring",        "with -l, stat files in batches through io_uring");
+    lusage( 0,  "queue-depth=N",   "with --io-uring, requests in flight (default 256)");
     lusage( 0,  "help",            "display this help and exit");
     lusage( 0,  "version",         "output version information and exit");
     fputc('\n', stdout);
@@ -269,209 +907,509 @@ set_all(void)
     ignore_files &= ~I_HIDDEN;
 }
 
+/* Compile a shell pattern, patterns made of a literal with a '*' 
+   on either or both ends get a fast path. */
 static void
-set_no_directories(void)
+compile_pattern(Pattern *pattern, const char *text)
 {
-    ignore_files |= I_DIR;
+    size_t len = strlen(text), first, last;
+    const char *special;
+
+    pattern->text = text;
+    pattern->type = PAT_GLOB;
+
+    /* Leading and trailing stars around a literal. */
+    for (first = 0; text[first] == '*'; ++first)
+        ;
+    for (last = len; last > first && text[last - 1] == '*'; --last)
+        ;
+
+    special = strpbrk(text + first, "*?[\\");
+    if (special != NULL && special < text + last)
+        return;
+
+    pattern->literal = text + first;
+    pattern->len = last - first;
+
+    if (first == 0 && last == len)
+        pattern->type = PAT_LITERAL;
+    else
+    if (first == 0)
+        pattern->type = PAT_PREFIX;
+    else
+    if (last == len)
+        pattern->type = PAT_SUFFIX;
+    else
+        pattern->type = PAT_INFIX;
 }
 
-static void 
-set_no_files(void)
+static void
+add_pattern(Pattern **patterns, size_t *n, const char *text)
 {
-    ignore_files |= I_REG;
+    *patterns = xrealloc(*patterns, (*n + 1) * sizeof(Pattern));
+    compile_pattern(&(*patterns)[(*n)++], text);
 }
 
-static Flag flags[] = {
-    { "all",            'a', &f_show_hidden    , set_all            },
-    { "almost-al",      'A', NULL,               set_almost_all     },
-    { "directory",      'd', NULL,               set_no_files       },
-    { "no-directories", 'D', NULL,               set_no_directories },
-    { "no_classify",    'F', &f_no_classify,     NULL     },
-    { NULL,             'l', &f_long_format    , NULL     },
-    { "no-color",       'C', &f_no_color       , NULL     },
-    { "num-perms",      'N', &f_numeric_perms  , NULL     },
-    { "recursive",      'R', &f_recursive      , NULL     },
-    { "numeric-uid-gid",'n', &f_print_owner_id , NULL     }, 
-    { "human-readable", 'h', &f_human_readable , NULL     },
-    { "version",        ' ', NULL,               version  },
-    { "help",           ' ', NULL,               usage    },
-    { NULL, 0, NULL, NULL }
-};
+static void
+add_ignore(const char *arg)
+{
+    add_pattern(&ignore_patterns, &num_ignore, arg);
+}
 
-static char **
-get_mode_string(struct stat st)
-{
-    char **str;
-    mode_t st_mode;
-   
-    str = xmalloc(4 * sizeof(char *));
-    st_mode = st.st_mode;
-
-    /* Type of file. */
-    str[0] = xmalloc(2);
-    str[0][0] = '-';
-    if (S_ISDIR(st_mode)) str[0][0] = 'd'; 
-    if (S_ISCHR(st_mode)) str[0][0] = 'c'; 
-    if (S_ISBLK(st_mode)) str[0][0] = 'b'; 
-    str[0][1] = '\0';
-
-    /* User permissions. */
-    str[1] = xmalloc(4);
-    str[1][0] = (st_mode & S_IRUSR) ? 'r' : '-'; 
-    str[1][1] = (st_mode & S_IWUSR) ? 'w' : '-';
-    str[1][2] = (st_mode & S_IXUSR) ? 'x' : '-';
-    str[1][3] = '\0';
-    
-    /* Group permissions. */
-    str[2] = xmalloc(4);
-    str[2][0] = (st_mode & S_IRGRP) ? 'r' : '-'; 
-    str[2][1] = (st_mode & S_IWGRP) ? 'w' : '-';
-    str[2][2] = (st_mode & S_IXGRP) ? 'x' : '-';
-    str[2][3] = '\0';
-    
-    /* Other permissions. */
-    str[3] = xmalloc(4);
-    str[3][0] = (st_mode & S_IROTH) ? 'r' : '-';
-    str[3][1] = (st_mode & S_IWOTH) ? 'w' : '-';
-    str[3][2] = (st_mode & S_IXOTH) ? 'x' : '-';
-    str[3][3] = '\0';
+static void
+add_hide(const char *arg)
+{
+    add_pattern(&hide_patterns, &num_hide, arg);
+}
 
-    return str;
+static void
+set_no_sort(void)
+{
+    f_unsorted = 1;
+    set_all();
 }
 
-static unsigned short int
-get_mode_num(const char *perm)
+static void
+set_sort_time(void)
 {
-    if (streq(perm, "--x"))
-        return 1;
+    sort_type = SORT_TIME;
+}
+
+static void
+set_sort_size(void)
+{
+    sort_type = SORT_SIZE;
+}
+
+static void
+set_sort_extension(void)
+{
+    sort_type = SORT_EXTENSION;
+}
+
+static void
+set_sort_version(void)
+{
+    sort_type = SORT_VERSION;
+}
+
+static void
+set_time(const char *arg)
+{
+    if (streq(arg, "mtime") || streq(arg, "modification"))
+        time_type = TIME_MTIME;
     else
-    if (streq(perm, "-w-"))
-        return 2;
+    if (streq(arg, "ctime") || streq(arg, "status"))
+        time_type = TIME_CTIME;
     else
-    if (streq(perm, "-wx"))
-        return 3;
+    if (streq(arg, "atime") || streq(arg, "access") || streq(arg, "use"))
+        time_type = TIME_ATIME;
+    else {
+        xerror("invalid argument '%s' for '--time'", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Whether fmt has a conversion for seconds or less. */
+static int
+has_seconds(const char *fmt)
+{
+    for (; *fmt != '\0'; ++fmt) {
+        if (*fmt != '%')
+            continue;
+
+        /* Skip flags, width and modifiers. */
+        while (strchr("_-0^#", fmt[1]) != NULL && fmt[1] != '\0')
+            ++fmt;
+        while ((fmt[1] >= '0' && fmt[1] <= '9') || fmt[1] == 'E' || fmt[1] == 'O')
+            ++fmt;
+
+        if (fmt[1] != '\0' && strchr("NSTcrsX+", fmt[1]) != NULL)
+            return 1;
+        if (fmt[1] != '\0')
+            ++fmt;
+    }
+    return 0;
+}
+
+static void
+set_time_style(const char *arg)
+{
+    char *fmt, *nl;
+
+    if (streq(arg, "full-iso"))
+        time_formats[0] = time_formats[1] = "%Y-%m-%d %H:%M:%S.%N %z";
     else
-    if (streq(perm, "r--"))
-        return 4;
+    if (streq(arg, "long-iso"))
+        time_formats[0] = time_formats[1] = "%Y-%m-%d %H:%M";
     else
-    if (streq(perm, "r-x"))
-        return 5;
+    if (streq(arg, "iso")) {
+        time_formats[0] = "%Y-%m-%d ";
+        time_formats[1] = "%m-%d %H:%M";
+    }
     else
-    if (streq(perm, "rw-"))
-        return 6;
+    if (streq(arg, "locale")) {
+        time_formats[0] = "%b %e  %Y";
+        time_formats[1] = "%b %e %H:%M";
+    }
     else
-    if (streq(perm, "rwx"))
-        return 7;
+    if (arg[0] == '+') {
+        /* "+OLD\nRECENT", or one format for both. */
+        fmt = dupstr(arg + 1);
+        time_formats[0] = time_formats[1] = fmt;
+        if ((nl = strchr(fmt, '\n')) != NULL) {
+            *nl = '\0';
+            time_formats[1] = nl + 1;
+        }
+    }
+    else {
+        xerror("invalid argument '%s' for '--time-style'", arg);
+        exit(EXIT_FAILURE);
+    }
 
-    return 0;
+    time_by_minute = !has_seconds(time_formats[0]) && !has_seconds(time_formats[1]);
 }
 
-static char *
-color_mode(const char *mode)
+static void
+set_sort(const char *arg)
 {
-    Color color = C_WHITE;
-
-    if (streq(mode, "r--"))
-        color = C_GREEN;
+    if (streq(arg, "none"))
+        f_unsorted = 1;
     else
-    if (streq(mode, "rw-"))
-        color = C_BLUE;
+    if (streq(arg, "name"))
+        sort_type = SORT_NAME;
     else
-    if (streq(mode, "rwx"))
-        color = C_CYAN;
+    if (streq(arg, "time"))
+        sort_type = SORT_TIME;
     else
-    if (streq(mode, "r-x"))
-        color = C_BROWN;
-
-    return color_string(color, CT_LIGHT, mode);
+    if (streq(arg, "size"))
+        sort_type = SORT_SIZE;
+    else
+    if (streq(arg, "extension"))
+        sort_type = SORT_EXTENSION;
+    else
+    if (streq(arg, "version"))
+        sort_type = SORT_VERSION;
+    else {
+        xerror("invalid argument '%s' for '--sort'", arg);
+        exit(EXIT_FAILURE);
+    }
+}
 
+static void
+set_format(const char *arg)
+{
+    if (streq(arg, "text"))
+        output_format = FORMAT_TEXT;
+    else
+    if (streq(arg, "json"))
+        output_format = FORMAT_JSON;
+    else
+    if (streq(arg, "csv"))
+        output_format = FORMAT_CSV;
+    else {
+        xerror("invalid argument '%s' for '--format'", arg);
+        exit(EXIT_FAILURE);
+    }
 }
 
-static char *
-color_mode_num(short unsigned int mode)
+static void
+set_zero(void)
 {
-    char color_str[2];
-    Color color = C_WHITE;
-    Color_type type = CT_LIGHT;
+    output_format = FORMAT_NUL;
+}
 
-    sprintf(color_str, "%d", mode);
+static void
+set_dump(const char *arg)
+{
+    dump_path = arg;
+}
 
-    switch (mode)
-    {
-    case 0:
-        color = C_RED;
-        break;
+static void
+set_load(const char *arg)
+{
+    load_path = arg;
+}
 
-    case 1:
-        color = C_GREEN;
-        type = CT_DARK;
-        break;
+static void
+set_cache_ttl(const char *arg)
+{
+    char *end;
+    long ttl;
 
-    case 2:
-        color = C_BROWN;
-        type = CT_DARK;
-        break;
+    errno = 0;
+    ttl = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || ttl < 0 || errno != 0) {
+        errno = 0;
+        xerror("invalid cache ttl -- '%s'", arg);
+        exit(EXIT_FAILURE);
+    }
+    cache_ttl = ttl;
+}
 
-    case 3:
-        color = C_PURPLE;
-        break;
+static void
+set_no_directories(void)
+{
+    ignore_files |= I_DIR;
+}
 
-    case 4:
-        color = C_GREEN;
-        break;
+static void 
+set_no_files(void)
+{
+    ignore_files |= I_REG;
+}
 
-    case 5:
-        color = C_BROWN;
-        break;
-   
-    case 6:
-        color = C_BLUE;
-        break;
+/* Size in bytes, optionally followed by K, M or G. */
+static void
+set_dir_buffer(const char *arg)
+{
+    char *end;
+    unsigned long size;
 
-    case 7:
-        color = C_CYAN;
+    size = strtoul(arg, &end, 10);
+    switch (*end)
+    {
+    case 'G': case 'g':
+        size *= 1024;
+        /* Fallthrough. */
+    case 'M': case 'm':
+        size *= 1024;
+        /* Fallthrough. */
+    case 'K': case 'k':
+        size *= 1024;
+        ++end;
         break;
-
     default:
         break;
-    
     }
 
-    return color_string(color, type, color_str);
+    if (end == arg || *end != '\0' || size == 0) {
+        xerror("invalid buffer size -- '%s'", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Has to fit at least one record with a maximum length name. */
+    dir_buffer_size = size < 4096 ? 4096 : size;
 }
 
 static void
-indent(size_t len)
+set_jobs(const char *arg)
 {
-    int i = len;
-    do 
-    {
-        putchar(' ');
-    } while (--i > 0);
+    char *end;
+    unsigned long jobs;
+
+    jobs = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || jobs == 0 || jobs > MAX_JOBS) {
+        xerror("invalid number of jobs -- '%s'", arg);
+        exit(EXIT_FAILURE);
+    }
+    num_jobs = jobs;
 }
 
-static char * 
-human_readable(double size)
+static void
+set_queue_depth(const char *arg)
 {
-    int i = 0;
-    const char* units[] = {" B", "kB", "MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
-    char *hr;
+    char *end;
+    unsigned long depth;
 
-    while (size > 1024) 
-    {
-        size /= 1024;
-        i++;
+    depth = strtoul(arg, &end, 10);
+    if (end == arg || *end != '\0' || depth == 0 || depth > 4096) {
+        xerror("invalid queue depth -- '%s'", arg);
+        exit(EXIT_FAILURE);
     }
-
-    hr = xmalloc(count_digits(size) + 7);
-    
-    sprintf(hr, "%.*f %s", i, size, units[i]);
-    
-    return hr;
+    queue_depth = depth;
 }
 
-static char
-get_indicator(const int type)
+static Flag flags[] = {
+    { "all",            'a', &f_show_hidden    , set_all            },
+    { "almost-al",      'A', NULL,               set_almost_all     },
+    { "directory",      'd', NULL,               set_no_files       },
+    { "no-directories", 'D', NULL,               set_no_directories },
+    { "no_classify",    'F', &f_no_classify,     NULL     },
+    { NULL,             'l', &f_long_format    , NULL     },
+    { "no-color",       'C', &f_no_color       , NULL     },
+    { "num-perms",      'N', &f_numeric_perms  , NULL     },
+    { "recursive",      'R', &f_recursive      , NULL     },
+    { NULL,             'U', &f_unsorted       , NULL     },
+    { NULL,             'f', NULL,               set_no_sort },
+    { NULL,             't', NULL,               set_sort_time },
+    { NULL,             'S', NULL,               set_sort_size },
+    { NULL,             'X', NULL,               set_sort_extension },
+    { NULL,             'v', NULL,               set_sort_version },
+    { "sort",           ' ', NULL,               NULL,    set_sort },
+    { "reverse",        'r', &f_reverse        , NULL     },
+    { "collate",        ' ', &f_collate        , NULL     },
+    { "time",           ' ', NULL,               NULL,    set_time },
+    { "time-style",     ' ', NULL,               NULL,    set_time_style },
+    { "ignore",         'I', NULL,               NULL,    add_ignore },
+    { "hide",           ' ', NULL,               NULL,    add_hide },
+    { "format",         ' ', NULL,               NULL,    set_format },
+    { "zero",           '0', NULL,               set_zero },
+    { "dump",           ' ', NULL,               NULL,    set_dump },
+    { "load",           ' ', NULL,               NULL,    set_load },
+    { "cache",          ' ', &f_cache          , NULL     },
+    { "cache-ttl",      ' ', NULL,               NULL,    set_cache_ttl },
+    { "du",             ' ', &f_du             , NULL     },
+    { "total-size",     ' ', &f_total_size     , NULL     },
+    { "numeric-uid-gid",'n', &f_print_owner_id , NULL     }, 
+    { "human-readable", 'h', &f_human_readable , NULL     },
+    { "getdents",       ' ', &f_getdents       , NULL     },
+    { "dir-buffer",     ' ', NULL,               NULL,    set_dir_buffer },
+    { "io-uring",       ' ', &f_io_uring       , NULL     },
+    { "queue-depth",    ' ', NULL,               NULL,    set_queue_depth },
+    { "jobs",           'j', NULL,               NULL,    set_jobs },
+    { "version",        ' ', NULL,               version  },
+    { "help",           ' ', NULL,               usage    },
+    { NULL, 0, NULL, NULL }
+};
+
+/* Colours of a permission triplet by its octal digit, in text and
+   numeric form (-N). */
+static const Color perm_colors[8] = {
+    C_WHITE, C_WHITE, C_WHITE, C_WHITE, 
+    C_GREEN, C_BROWN, C_BLUE,  C_CYAN
+};
+
+static const struct {
+    Color color;
+    Color_type type;
+} perm_num_colors[8] = {
+    { C_RED,    CT_LIGHT },
+    { C_GREEN,  CT_DARK  },
+    { C_BROWN,  CT_DARK  },
+    { C_PURPLE, CT_LIGHT },
+    { C_GREEN,  CT_LIGHT },
+    { C_BROWN,  CT_LIGHT },
+    { C_BLUE,   CT_LIGHT },
+    { C_CYAN,   CT_LIGHT }
+};
+
+/* Build mode_table, one entry for every combination of the 
+   permission bits including setuid, setgid and sticky. */
+static void
+init_mode_table(void)
+{
+    static const char special[3] = { 's', 's', 't' };
+    static const mode_t special_bits[3] = { S_ISUID, S_ISGID, S_ISVTX };
+    Mode_entry *entry;
+    unsigned int mode, i, digit;
+    char *text;
+
+    for (mode = 0; mode < MODE_TABLE_SIZE; ++mode) {
+        entry = &mode_table[mode];
+
+        for (i = 0; i < 3; ++i) {
+            digit = mode >> (6 - 3 * i) & 07;
+            text = entry->text + 3 * i;
+
+            text[0] = digit & 04 ? 'r' : '-';
+            text[1] = digit & 02 ? 'w' : '-';
+            text[2] = digit & 01 ? 'x' : '-';
+
+            /* Lower case when executable as well. */
+            if (mode & special_bits[i])
+                text[2] = digit & 01 ? special[i] : special[i] - 'a' + 'A';
+
+            entry->digits[i] = digit;
+        }
+    }
+}
+
+static char
+get_type_char(mode_t mode)
+{
+    if (S_ISDIR(mode))
+        return 'd';
+    if (S_ISCHR(mode))
+        return 'c';
+    if (S_ISBLK(mode))
+        return 'b';
+
+    return '-';
+}
+
+static void
+put_mode(mode_t mode)
+{
+    const Mode_entry *entry = &mode_table[mode & (MODE_TABLE_SIZE - 1)];
+    char type = get_type_char(mode);
+    Color color = C_WHITE;
+    size_t i;
+
+    if (f_no_color) {
+        out_char(type);
+        out_write(entry->text, 9);
+        return;
+    }
+
+    switch (type)
+    {
+    case 'd':
+        color = C_PURPLE;
+        break;
+    case 'c':
+        color = C_BROWN;
+        break;
+    case 'b':
+        color = C_RED;
+        break;
+    default:
+        break;
+    }
+
+    out_color(color, CT_LIGHT);
+    out_char(type);
+    out_reset();
+
+    for (i = 0; i < 3; ++i) {
+        if (f_numeric_perms) {
+            out_color(perm_num_colors[entry->digits[i]].color, 
+                      perm_num_colors[entry->digits[i]].type);
+            out_char('0' + entry->digits[i]);
+        } else {
+            out_color(perm_colors[entry->digits[i]], CT_LIGHT);
+            out_write(entry->text + 3 * i, 3);
+        }
+        out_reset();
+    }
+}
+
+/* Writes the human readable form of size into buf, which should 
+   hold at least HR_SIZE bytes. Returns the length. */
+#define HR_SIZE 32
+
+static size_t 
+human_readable(char *buf, unsigned long size)
+{
+    static const char *units[] = {" B", "kB", "MB", "GB", "TB", "PB", "EB"};
+    int scale = size_scale(size);
+    size_t len = format_fixed(buf, size, 10 * scale, scale);
+
+    buf[len++] = ' ';
+    memcpy(buf + len, units[scale], 3);
+    return len + 2;
+}
+
+/* Prints str right aligned to width, optionally colored. */
+static void
+put_field(const char *str, size_t len, size_t width, Color color)
+{
+    if (len < width)
+        out_pad(width - len);
+
+    if (f_no_color) {
+        out_write(str, len);
+        return;
+    }
+
+    out_color(color, CT_NORMAL);
+    out_write(str, len);
+    out_reset();
+}
+
+
+static char
+get_indicator(const int type)
 {
     char ind = 0;
  
@@ -515,243 +1453,343 @@ new_dir(void)
 
     dir = xmalloc(sizeof(Dir_data));
 
-    dir->num_files = 0;
+    arena_init(&dir->arena);
+    dir->num_files = dir->files_size = 0;
+    dir->num_cols = 0;
+    dir->col_widths = NULL;
     dir->luser = dir->lgroup = dir->lnlink = dir->lfsize = dir->lname = 0;
+    dir->sname = SIZE_MAX;
     dir->num_rows = 1;
-    dir->current_row = dir->current_col = 0;
-    dir->current_file = 0;
     dir->path = NULL;
     dir->files = NULL;
+    dir->subdirs = NULL;
+    dir->num_subdirs = 0;
+    dir->sub_names = NULL;
+    dir->map = NULL;
+    dir->map_size = 0;
+    dir->failed = 0;
+    dir->apparent = dir->allocated = 0;
+    dir->links = NULL;
+    dir->num_links = 0;
+    dir->dev = dir->ino = 0;
 
     return dir;
 }
 
+/* Print a single file, the caller pads columns. */
 static void 
-print_file(Dir_data *dir)
+print_file(Dir_data *dir, File_data *file)
 {
-    char *name, *m_type, *m_user, *m_group, *m_other,
-         *nlink, *user, *group, *fsize, *mtime, *tmp,
-         *ind;
+    char num[HR_SIZE];
+    size_t len;
     Color color = C_WHITE;
-    Color_type color_type = CT_LIGHT;
-    File_data *file;
 
-    if (f_long_format || print_file_nl)
-        file = dir->files[dir->current_file++];
-    else
+    if (f_long_format)
     {
-        if (dir->columns[dir->current_col] == NULL)
-        {
-            dir->current_row++;
-            dir->current_col = 0;
-        }
-        
-        if (dir->columns[dir->current_col][dir->current_row] == NULL)
-            return;
-        
-        if (dir->current_col == 0 && dir->current_row > 0)
-            putchar('\n');
-
-        file = dir->columns[dir->current_col][dir->current_row];
-    }
+        put_mode(file->mode);
+        out_char(' ');
 
-    if (f_no_color)
-    {
-        if (!f_no_classify && file->indicator != 0)
-        {
-            name = xmalloc(file->nlen + 2);
-            sprintf(name, "%s%c", file->name, file->indicator);
-        }
-        else
-            name = dupstr(file->name);
-        
-        m_type  = dupstr(file->mode[0]);
-        m_user  = dupstr(file->mode[1]);
-        m_group = dupstr(file->mode[2]);
-        m_other = dupstr(file->mode[3]);
+        len = format_num(num, file->nlink);
+        put_field(num, len, dir->lnlink, C_WHITE);
+        out_char(' ');
 
-        user = dupstr(file->user);
-        group = dupstr(file->group);
-        mtime = dupstr(file->mtime);
+        put_field(file->user, strlen(file->user), dir->luser, C_GREEN);
+        out_char(' ');
+        put_field(file->group, strlen(file->group), dir->lgroup, C_GREEN);
+        out_char(' ');
 
         if (f_human_readable)
-            fsize = human_readable(file->fsize);
-        else 
-        {
-            fsize = xmalloc(10);
-            sprintf(fsize, "%ld", file->fsize);
+            len = human_readable(num, file->fsize);
+        else
+            len = format_num(num, file->fsize);
+        put_field(num, len, dir->lfsize, C_WHITE);
+        out_char(' ');
+
+        if (f_no_color) {
+            out_puts(file->time_str);
+        } else {
+            out_color(C_RED, CT_NORMAL);
+            out_puts(file->time_str);
+            out_reset();
         }
+        out_char(' ');
+    }
 
-        nlink = xmalloc(10);
-        sprintf(nlink, "%d", file->nlink);
+    if (f_no_color)
+    {
+        out_puts(file->name);
+        if (!f_no_classify && file->indicator != 0)
+            out_char(file->indicator);
     }
     else
     {
-        switch (file->mode[0][0])
-        {
-        case 'd':
-            color = C_PURPLE;
-            break;
-        case 'c':
-            color = C_BROWN;
-            break;
-        case 'b':
-            color = C_RED;
-            break;
-        default:
-            break;
-        }
-        m_type = color_string(color, CT_LIGHT, file->mode[0]);
-        if (f_numeric_perms)
-        {
-            m_user = color_mode_num(get_mode_num(file->mode[1]));
-            m_group = color_mode_num(get_mode_num(file->mode[2]));
-            m_other = color_mode_num(get_mode_num(file->mode[3]));
-        }
-        else
-        {
-            m_user = color_mode(file->mode[1]);
-            m_group = color_mode(file->mode[2]);
-            m_other = color_mode(file->mode[3]);
-        }
-
         switch (file->type)
         {
             case FT_BLOCK:
+            case FT_LINK:
                 color = C_BLUE;
-                color_type = CT_NORMAL;
                 break;
 
             case FT_CHAR:
                 color = C_GREEN;
-                color_type = CT_NORMAL;
                 break;
 
             case FT_DIR:
-                color = C_BROWN;
-                color_type = CT_LIGHT;
-                break;
-
             case FT_FIFO:
                 color = C_BROWN;
-                color_type = CT_NORMAL;
-                break;
-
-            case FT_LINK:
-                color = C_BLUE;
-                color_type = CT_LIGHT;
                 break;
 
             case FT_SOCK:
                 color = C_WHITE;
-                color_type = CT_NORMAL;
                 break;
 
             case FT_WHITE:
                 color = C_RED;
-                color_type = CT_LIGHT;
                 break;
 
             case FT_EXEC:
                 color = C_CYAN;
-                color_type = CT_LIGHT;
                 break;
 
             default:
                 break;
         }
   
+        out_color(color, CT_LIGHT);
+        out_puts(file->name);
         if (!f_no_classify && file->indicator != 0)
         {
-            ind = color_char(C_RED, CT_LIGHT, file->indicator);
-            tmp = xmalloc(file->nlen + strlen(ind) + 1);
-            sprintf(tmp, "%s%s", file->name, ind);
-            name = color_string(color, CT_LIGHT, tmp);
-            free(tmp);
-        }
-        else
-            name  = color_string(color, CT_LIGHT,  file->name);
-        
-        user  = color_string(C_GREEN, CT_NORMAL, file->user);
-        group = color_string(C_GREEN, CT_NORMAL, file->group);
-        mtime = color_string(C_RED,   CT_NORMAL, file->mtime);
-  
-        if (f_human_readable)
-            tmp = human_readable(file->fsize);
-        else 
-        {
-            tmp = xmalloc(10);
-            sprintf(tmp, "%ld", file->fsize);
+            out_color(C_RED, CT_LIGHT);
+            out_char(file->indicator);
+            out_reset();
         }
+        out_reset();
+    }
 
-        fsize = color_string(C_WHITE, CT_NORMAL, tmp);
-        free(tmp);
+    if (f_long_format || print_file_nl)
+        out_char('\n');
+}
 
-        nlink = color_num(C_WHITE, CT_NORMAL, file->nlink);
+/* Writes a signed number. */
+static void
+put_signed(long num)
+{
+    if (num < 0) {
+        out_char('-');
+        out_num(-(unsigned long)num);
+    } else {
+        out_num(num);
     }
+}
 
-    if (f_long_format)
-    {
-        fprintf(stdout, "%s%s%s%s %*s %*s %*s %*s %.19s %s\n", 
-                m_type, m_user, m_group, m_other, 
-                dir->lnlink, nlink, 
-                dir->luser, user, 
-                dir->lgroup, group,
-                dir->lfsize, fsize, 
-                mtime, name);
-    }
-    else
-    if (print_file_nl)
+/* Print a file as a record for --format or -0. with_path prefixes
+   the name with its directory for -0, where there are no headers. */
+static void
+print_record(const Dir_data *dir, const File_data *file, int with_path)
+{
+    switch (output_format)
     {
-        fprintf(stdout, "%s\n", name); 
+    case FORMAT_JSON:
+        out_puts("{\"dir\":");
+        out_json_string(dir->path);
+        out_puts(",\"name\":");
+        out_json_string(file->name);
+        out_puts(",\"type\":\"");
+        out_puts(type_names[file->type]);
+        out_puts("\",\"mode\":");
+        out_num(file->mode);
+        out_puts(",\"nlink\":");
+        out_num(file->nlink);
+        out_puts(",\"uid\":");
+        out_num(file->uid);
+        out_puts(",\"gid\":");
+        out_num(file->gid);
+        out_puts(",\"size\":");
+        put_signed(file->fsize);
+        out_puts(",\"time\":");
+        put_signed(file->time);
+        out_puts(",\"time_nsec\":");
+        out_num(file->time_nsec);
+        out_write("}\n", 2);
+        break;
+
+    case FORMAT_CSV:
+        out_csv_field(dir->path);
+        out_char(',');
+        out_csv_field(file->name);
+        out_char(',');
+        out_puts(type_names[file->type]);
+        out_char(',');
+        out_num(file->mode);
+        out_char(',');
+        out_num(file->nlink);
+        out_char(',');
+        out_num(file->uid);
+        out_char(',');
+        out_num(file->gid);
+        out_char(',');
+        put_signed(file->fsize);
+        out_char(',');
+        put_signed(file->time);
+        out_char(',');
+        out_num(file->time_nsec);
+        out_char('\n');
+        break;
+
+    default:
+        if (with_path) {
+            out_puts(dir->path);
+            out_char('/');
+        }
+        out_puts(file->name);
+        out_char('\0');
+        break;
     }
-    else 
-    {
-        fprintf(stdout, "%s", name); 
-        indent(dir->max_per_col[dir->current_col] -    
-               dir->columns[dir->current_col][dir->current_row]->nlen +  1);
-        dir->current_col++;
+}
+
+static void
+init_fit(Column_fit *fit, size_t n, size_t num_cols, size_t *widths)
+{
+    fit->num_cols = num_cols;
+    fit->rows = (n + num_cols - 1) / num_cols;
+    fit->next = fit->width = fit->line_len = fit->cols = 0;
+    fit->widths = widths;
+}
+
+/* Add the len files from first on, with the given widths, to the 
+   layout of fit. Columns get the files in order, rows at a time. */
+static inline void
+add_to_fit(Column_fit *fit, size_t first, const size_t *widths, size_t len)
+{
+    size_t j = 0, end, width = fit->width;
+
+    while (j < len) {
+        if (first + j == fit->next) {
+            if (fit->next > 0) {
+                fit->widths[fit->cols++] = width;
+                fit->line_len += width + 1;
+            }
+            fit->next += fit->rows;
+            width = 0;
+        }
+        end = fit->next - first < len ? fit->next - first : len;
+        for (; j < end; ++j) {
+            if (widths[j] > width)
+                width = widths[j];
+        }
     }
+    fit->width = width;
+}
 
-    free(name);
-    free(user);
-    free(group);
-    free(mtime);
-    free(fsize);
-    free(nlink);
-    free(m_user);
-    free(m_group);
-    free(m_other);
-    free(m_type);
+/* Whether the layout so far is wider than the line. The last column
+   has no space after it. */
+static inline int
+fit_too_wide(const Column_fit *fit, size_t line_width)
+{
+    return fit->line_len + fit->width > line_width;
 }
 
+/* Files whose widths are gathered before adding them to the layouts,
+   so that each layout goes over them in a tight loop. */
+#define FIT_CHUNK 256
+
+/* Find the largest number of columns the files fit in, each column
+   as wide as its widest file. Any count where every column is as
+   wide as the widest file fits, and none where they're as narrow 
+   as the narrowest one doesn't, so only the ones in between are 
+   tried. They're worked out together in a single pass over the 
+   names, and a layout is dropped once it's wider than the line. */
 static void
-prepare_columns(Dir_data *dir)
+layout_columns(Dir_data *dir)
 {
-    size_t i, j, k;
-
-    dir->num_cols = dir->num_files / dir->num_rows;
+    size_t i, j, k, c, len, n = dir->num_files, lo, hi, num_fits = 0,
+           line_width = window_width > 0 ? window_width : DEFAULT_WIDTH;
+    size_t chunk[FIT_CHUNK];
+    size_t *widths;
+    Column_fit *best = NULL;
+
+    lo = (line_width + 1) / (dir->lname + 1);
+    hi = dir->sname < line_width ? (line_width + 1) / (dir->sname + 1) : 1;
+    if (hi > n)
+        hi = n;
+    if (hi < 1)
+        hi = 1;
+    if (lo < 1)
+        lo = 1;
+    if (lo > hi)
+        lo = hi;
+
+    if (hi >= max_fits) {
+        max_fits = hi + 1;
+        column_fits = xrealloc(column_fits, max_fits * sizeof(Column_fit));
+        column_widths = xrealloc(column_widths, max_fits * max_fits / 2 * sizeof(size_t));
+    }
 
-    dir->columns = xmalloc((dir->num_cols + 1) * sizeof(File_data **));
-    dir->max_per_col = xmalloc((dir->num_cols + 2) * sizeof(size_t));
+    widths = column_widths;
+    for (c = hi; c > lo; --c) {
+        init_fit(&column_fits[num_fits++], n, c, widths);
+        widths += c;
+    }
 
-    for (i = k = 0; i < dir->num_cols; ++i)
-    {
-        dir->columns[i] = xmalloc((dir->num_rows + 1) * sizeof(char *));
-        dir->max_per_col[i] = 0;
+    for (i = 0; i < n && num_fits > 0; i += len) {
+        len = n - i < FIT_CHUNK ? n - i : FIT_CHUNK;
+        for (j = 0; j < len; ++j)
+            chunk[j] = dir->files[i + j]->nlen;
+
+        for (k = 0; k < num_fits;) {
+            add_to_fit(&column_fits[k], i, chunk, len);
+            if (fit_too_wide(&column_fits[k], line_width))
+                column_fits[k] = column_fits[--num_fits];
+            else
+                ++k;
+        }
+    }
 
-        for (j = 0; j < dir->num_rows && k < dir->num_files; ++j)
-        {
-            if (dir->max_per_col[i] < dir->files[k]->nlen)
-                dir->max_per_col[i] = dir->files[k]->nlen;
+    for (k = 0; k < num_fits; ++k) {
+        if (best == NULL || column_fits[k].num_cols > best->num_cols)
+            best = &column_fits[k];
+    }
 
-            dir->columns[i][j] = dir->files[k++];
+    /* Otherwise lo fits, unless a name is wider than the line, in 
+       which case lo is 1 anyway. */
+    if (best == NULL) {
+        best = &column_fits[0];
+        init_fit(best, n, lo, widths);
+        for (i = 0; i < n; i += len) {
+            len = n - i < FIT_CHUNK ? n - i : FIT_CHUNK;
+            for (j = 0; j < len; ++j)
+                chunk[j] = dir->files[i + j]->nlen;
+            add_to_fit(best, i, chunk, len);
         }
+    }
+
+    best->widths[best->cols] = best->width;
+    dir->col_widths = best->widths;
+    dir->num_rows = best->rows;
+    dir->num_cols = (n + dir->num_rows - 1) / dir->num_rows;
+}
+
+static void
+print_columns(Dir_data *dir)
+{
+    size_t row, col, i;
+
+    if (dir->num_files == 0)
+        return;
+
+    layout_columns(dir);
 
-        dir->columns[i][j] = NULL;
+    for (row = 0; row < dir->num_rows; ++row) {
+        for (col = 0; col < dir->num_cols; ++col) {
+            if ((i = col * dir->num_rows + row) >= dir->num_files)
+                break;
+
+            if (col > 0)
+                out_pad(dir->col_widths[col - 1] - dir->files[i - dir->num_rows]->nlen + 1);
+            print_file(dir, dir->files[i]);
+        }
+        out_char('\n');
     }
-        
-    dir->columns[i] = NULL;
 }
 
 static void
@@ -759,316 +1797,2795 @@ print_files(Dir_data *dir)
 {
     size_t i;
 
-    if (!f_long_format && !print_file_nl)
-        prepare_columns(dir);
-    else
-        dir->columns = NULL;
-
     if (f_human_readable)
         dir->lfsize = 7; 
 
-    if (!f_no_color) {
-        dir->luser += 11;
-        dir->lgroup += 11;
-        dir->lnlink += 11; 
-        dir->lfsize += 11;
-        dir->lname += 11;
-    }
-
-    for (i = 0; i < dir->num_files; ++i)
-        print_file(dir);
-
-    if ((!print_file_nl && !f_long_format))
-        fputc('\n', stdout);
+    if (!f_long_format && !print_file_nl)
+        print_columns(dir);
+    else
+        for (i = 0; i < dir->num_files; ++i)
+            print_file(dir, dir->files[i]);
 
     if (f_recursive)
-        fputc('\n', stdout);
+        out_char('\n');
 
 }
 
 static void
-free_dirs(void)
+free_dir(Dir_data *dir)
 {
-    size_t i, j;
-    File_data *file;
+    free(dir->files);
+    free(dir->subdirs);
+    arena_free(&dir->arena);
+    if (dir->map != NULL)
+        munmap(dir->map, dir->map_size);
+    free(dir);
+}
 
-    for (i = num_dirs; i--;) {
-        for (j = dirs[i]->num_files; j--;) {
-            file = dirs[i]->files[j];
-            free(file->name);
-            free(file->user);
-            free(file->group);
-            free_array(file->mode, 4);
-            free(file);
-        }
-        free(dirs[i]->files);
-        for (j = dirs[i]->num_cols; j--;)
-            free(dirs[i]->columns[j]);
-        
-        free(dirs[i]->columns);
-        free(dirs[i]->path);
-        free(dirs[i]->max_per_col);
-        free(dirs[i]);
+/* Up to the first 8 bytes of str, in an order that compares like
+   strcmp() does. */
+static uint64_t
+prefix_key(const char *str)
+{
+    uint64_t key = 0;
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        key <<= 8;
+        if (*str != '\0')
+            key |= (unsigned char)*str++;
     }
-    free(dirs);
+    return key;
+}
+
+/* Extension of name, "" when it has none. */
+static const char *
+get_extension(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    return ext != NULL && ext != name ? ext : "";
+}
+
+/* Ties are broken by the order the keys were made in, which makes
+   every comparison a total order. */
+static int
+compare_index(const Sort_key *key1, const Sort_key *key2)
+{
+    return (key1->idx > key2->idx) - (key1->idx < key2->idx);
 }
 
 static int
 sort_by_name(const void *v1, const void *v2)
 {
-    const File_data *file1 = *(const File_data **)v1;
-    const File_data *file2 = *(const File_data **)v2;
+    const Sort_key *key1 = v1, *key2 = v2;
+    int cmp;
+
+    if (key1->key != key2->key)
+        return key1->key < key2->key ? -1 : 1;
+
+    if ((cmp = strcmp(key1->name, key2->name)) != 0)
+        return cmp;
 
-    return strcmp(file1->name, file2->name);
+    return compare_index(key1, key2);
 }
 
-static char *
-get_user_name(struct stat st)
+static int
+sort_by_extension(const void *v1, const void *v2)
 {
-    char *name = NULL; 
-    uid_t uid = st.st_uid;
-    Xpasswd *xpwd;
+    const Sort_key *key1 = v1, *key2 = v2;
+    int cmp;
 
-    if (f_print_owner_id)
-        return num_to_str(uid);
+    if (key1->key != key2->key)
+        return key1->key < key2->key ? -1 : 1;
 
-	if ((xpwd = get_passwd(uid)) == NULL) {
-        name = xmalloc(10);
-		sprintf(name, "%d", uid);
-	}
-	else {
-		name = dupstr(xpwd->name);
-        free_passwd(xpwd);
-    }
+    if ((cmp = strcmp(get_extension(key1->name), get_extension(key2->name))) != 0)
+        return cmp;
 
-    return name;
+    if ((cmp = strcmp(key1->name, key2->name)) != 0)
+        return cmp;
+
+    return compare_index(key1, key2);
 }
 
-static char *
-get_group_name(struct stat st)
+static int
+sort_by_version(const void *v1, const void *v2)
 {
-    char *name = NULL; 
-    gid_t gid = st.st_gid;
-    Xgroup *group;
+    const Sort_key *key1 = v1, *key2 = v2;
+    int cmp;
+
+    if ((cmp = strverscmp(key1->name, key2->name)) != 0)
+        return cmp;
+
+    return compare_index(key1, key2);
+}
+
+/* Stable LSD radix sort on the numeric keys, a byte per pass. 
+   Passes where every key has the same byte are skipped. */
+static void
+radix_sort(Sort_key *keys, Sort_key *tmp, size_t n)
+{
+    size_t count[256], i, sum, c;
+    int shift;
+    Sort_key *swap, *result = keys;
+
+    for (shift = 0; shift < 64; shift += 8) {
+        memset(count, 0, sizeof count);
+        for (i = 0; i < n; ++i)
+            ++count[(keys[i].key >> shift) & 0xff];
 
-    if (f_print_owner_id)
-        return num_to_str(gid);
+        if (count[keys[0].key >> shift & 0xff] == n)
+            continue;
+
+        for (i = sum = 0; i < 256; ++i) {
+            c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+
+        for (i = 0; i < n; ++i)
+            tmp[count[(keys[i].key >> shift) & 0xff]++] = keys[i];
 
-	if ((group = get_group(gid)) == NULL) {
-        name = xmalloc(10);
-		sprintf(name, "%d", gid);
-	}
-	else {
-		name = dupstr(group->name);
-        free_group(group);
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
     }
 
-    return name;
+    /* An odd number of passes leaves the result in tmp. */
+    if (keys != result)
+        memcpy(result, keys, n * sizeof(Sort_key));
 }
-static Filetype
-get_filetype(unsigned char t)
+
+/* Comparator giving the final order of the keys for sort_type. */
+static Compare_function
+key_compare(void)
 {
-    switch (t) {
-    case DT_BLK:
-        return FT_BLOCK;
-    case DT_CHR: 
-        return FT_CHAR;
-    case DT_DIR:
-        return FT_DIR;
-    case DT_FIFO:
-        return FT_FIFO;
-    case DT_LNK:
-        return FT_LINK;
-    case DT_REG:
-        return FT_REG;
-    case DT_SOCK:
-        return FT_SOCK;
-    case DT_WHT: 
-        return FT_WHITE;
+    switch (sort_type)
+    {
+    case SORT_EXTENSION:
+        return sort_by_extension;
+
+    case SORT_VERSION:
+        return sort_by_version;
+
+    default:
+        /* Numeric keys compare as numbers, then by name. */
+        return sort_by_name;
+    }
+}
+
+/* Sort keys on a single thread, tmp holds room for n keys. */
+static void
+sort_keys(Sort_key *keys, Sort_key *tmp, size_t n)
+{
+    size_t i, j;
+
+    switch (sort_type)
+    {
+    case SORT_TIME:
+    case SORT_SIZE:
+        radix_sort(keys, tmp, n);
+
+        /* Equal keys are ordered by name. */
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && keys[j].key == keys[i].key; ++j)
+                ;
+            if (j - i > 1)
+                qsort(keys + i, j - i, sizeof(Sort_key), sort_by_name);
+        }
+        break;
+
     default:
+        qsort(keys, n, sizeof(Sort_key), key_compare());
         break;
     }
-    return FT_UNKOWN;
 }
 
+/* Run jobs on their own threads, the first on the calling one. */
 static void
-store_longest(Dir_data *dir, File_data *file)
+run_sort_jobs(Sort_job *jobs, size_t num_jobs, void *(*run)(void *))
 {
-    int count;
+    size_t i, started;
 
-    if (file->nlen > dir->lname)
-        dir->lname = file->nlen;
-    
-    if ((count = count_digits(file->nlink)) > dir->lnlink)
-        dir->lnlink = count;
+    for (started = 1; started < num_jobs; ++started) {
+        if (pthread_create(&jobs[started].thread, NULL, run, &jobs[started]) != 0)
+            break;
+    }
 
-    if ((count = strlen(file->user)) > dir->luser)
-        dir->luser = count;
+    run(&jobs[0]);
 
-    if ((count = strlen(file->group)) > dir->lgroup)
-        dir->lgroup = count;
+    /* Jobs we couldn't start a thread for run here. */
+    for (i = started; i < num_jobs; ++i)
+        run(&jobs[i]);
 
-    if ((count = count_digits(file->fsize)) > dir->lfsize)
-        dir->lfsize = count;
+    for (i = 1; i < started; ++i)
+        pthread_join(jobs[i].thread, NULL);
 }
 
-static int 
-is_dir(const char *f)
+/* Threads to sort n keys with, one per SORT_PARALLEL_MIN keys up
+   to the number of processors. */
+static size_t
+sort_threads(size_t n)
 {
-    DIR *dir;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = n / SORT_PARALLEL_MIN;
 
-    dir = opendir(f);
-    if (dir == NULL) {
-        errno = 0;
-        return 0;
-    }
-    closedir(dir);
-    return 1;
+    if (cpus < 1)
+        cpus = 1;
+    if (threads > (size_t)cpus)
+        threads = cpus;
+    if (threads > SORT_MAX_THREADS)
+        threads = SORT_MAX_THREADS;
+
+    return threads;
 }
 
-static int
-ignore_file(const char *f)
+static void *
+sort_job(void *arg)
 {
-    int isdir;
+    Sort_job *job = arg;
 
-    isdir = is_dir(f);
-    return (
-        (ignore_files & I_HIDDEN 
-            && f[0] == '.') ||
-        (ignore_files & I_DOTS   
-            && (streq(f, ".") || streq(f, ".."))) ||
-        (ignore_files & I_DIR
-            && isdir) ||
-        (ignore_files & I_REG
-            && !isdir));
+    sort_keys(job->keys, job->tmp, job->n);
+    return NULL;
 }
 
+/* Merge the sorted runs keys and keys + n1 into out. */
+static void *
+merge_job(void *arg)
+{
+    Sort_job *job = arg;
+    Compare_function cmp = key_compare();
+    const Sort_key *a = job->keys, *b = job->keys + job->n1,
+                   *a_end = b, *b_end = job->keys + job->n;
+    Sort_key *out = job->tmp;
+
+    while (a < a_end && b < b_end) {
+        if (cmp(b, a) < 0)
+            *out++ = *b++;
+        else
+            *out++ = *a++;
+    }
+
+    memcpy(out, a, (a_end - a) * sizeof(Sort_key));
+    out += a_end - a;
+    memcpy(out, b, (b_end - b) * sizeof(Sort_key));
+
+    return NULL;
+}
+
+/* Sort keys by splitting them across threads and merging the runs
+   pairwise, each merge on its own thread. Every comparator is a 
+   total order, so the result is the same as sort_keys(). */
+static void
+sort_keys_parallel(Sort_key *keys, Sort_key *tmp, size_t n, size_t num_threads)
+{
+    Sort_job jobs[SORT_MAX_THREADS];
+    size_t bounds[SORT_MAX_THREADS + 1];
+    size_t i, k, runs = num_threads;
+    Sort_key *swap, *result = keys;
+
+    for (i = 0; i <= runs; ++i)
+        bounds[i] = n / runs * i + (i == runs ? n % runs : 0);
+
+    for (i = 0; i < runs; ++i) {
+        jobs[i].keys = keys + bounds[i];
+        jobs[i].tmp = tmp + bounds[i];
+        jobs[i].n = bounds[i + 1] - bounds[i];
+    }
+    run_sort_jobs(jobs, runs, sort_job);
+
+    while (runs > 1) {
+        for (i = k = 0; i + 1 < runs; i += 2, ++k) {
+            jobs[k].keys = keys + bounds[i];
+            jobs[k].tmp = tmp + bounds[i];
+            jobs[k].n1 = bounds[i + 1] - bounds[i];
+            jobs[k].n = bounds[i + 2] - bounds[i];
+        }
+        run_sort_jobs(jobs, k, merge_job);
+
+        /* An odd run out is carried over as is. */
+        if (runs % 2 == 1)
+            memcpy(tmp + bounds[runs - 1], keys + bounds[runs - 1],
+                   (n - bounds[runs - 1]) * sizeof(Sort_key));
+
+        for (i = 0; 2 * i < runs; ++i)
+            bounds[i] = bounds[2 * i];
+        bounds[i] = n;
+        runs = i;
+
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    if (keys != result)
+        memcpy(result, keys, n * sizeof(Sort_key));
+}
+/* Collation key of name for the current locale, bytes compare 
+   with strcmp() like the names do with strcoll(). */
+static const char *
+collate_key(Arena *arena, const char *name)
+{
+    size_t len;
+    char *key;
+
+    len = strxfrm(NULL, name, 0);
+    key = arena_alloc(arena, len + 1);
+    strxfrm(key, name, len + 1);
+
+    return key;
+}
+
+/* Sort files in place on sort_type, reversed with -r. Collation 
+   keys are allocated from arena. */
+static void
+sort_files(Arena *arena, File_data **files, size_t n)
+{
+    Sort_key *keys, *tmp;
+    File_data **sorted;
+    uint64_t sec;
+    size_t i, threads;
+    int collate;
+
+    if (n < 2)
+        return;
+
+    /* Extensions and versions are compared on the names. */
+    collate = f_collate && sort_type != SORT_EXTENSION && sort_type != SORT_VERSION;
+
+    keys = xmalloc(n * sizeof(Sort_key));
+    for (i = 0; i < n; ++i) {
+        keys[i].name = collate ? collate_key(arena, files[i]->name) : files[i]->name;
+        keys[i].idx = i;
+
+        switch (sort_type)
+        {
+        case SORT_TIME:
+            /* Seconds biased to be positive, nanoseconds in the 
+               low 30 bits, newest first. */
+            sec = (uint64_t)files[i]->time + ((uint64_t)1 << 33);
+            keys[i].key = ~(sec << 30 | files[i]->time_nsec);
+            break;
+
+        case SORT_SIZE:
+            keys[i].key = ~(uint64_t)files[i]->fsize;
+            break;
+
+        case SORT_EXTENSION:
+            keys[i].key = prefix_key(get_extension(files[i]->name));
+            break;
+
+        default:
+            keys[i].key = prefix_key(keys[i].name);
+            break;
+        }
+    }
+
+    tmp = xmalloc(n * sizeof(Sort_key));
+    if ((threads = sort_threads(n)) > 1)
+        sort_keys_parallel(keys, tmp, n, threads);
+    else
+        sort_keys(keys, tmp, n);
+    free(tmp);
+
+    sorted = xmalloc(n * sizeof(File_data *));
+    for (i = 0; i < n; ++i)
+        sorted[f_reverse ? n - i - 1 : i] = files[keys[i].idx];
+
+    memcpy(files, sorted, n * sizeof(File_data *));
+    free(sorted);
+    free(keys);
+}
+
+/* Name of the owner, cached names are used as is. */
+static const char *
+get_user_name(Arena *arena, struct stat st)
+{
+    char *name; 
+    const char *cached;
+    uid_t uid = st.st_uid;
+
+    if (!f_print_owner_id && (cached = user_name(uid)) != NULL)
+        return cached;
+
+    name = arena_alloc(arena, 12);
+    sprintf(name, "%u", (unsigned int)uid);
+    return name;
+}
+
+static const char *
+get_group_name(Arena *arena, struct stat st)
+{
+    char *name; 
+    const char *cached;
+    gid_t gid = st.st_gid;
+
+    if (!f_print_owner_id && (cached = group_name(gid)) != NULL)
+        return cached;
+
+    name = arena_alloc(arena, 12);
+    sprintf(name, "%u", (unsigned int)gid);
+    return name;
+}
+
+static Filetype
+get_filetype(unsigned char t)
+{
+    switch (t) {
+    case DT_BLK:
+        return FT_BLOCK;
+    case DT_CHR: 
+        return FT_CHAR;
+    case DT_DIR:
+        return FT_DIR;
+    case DT_FIFO:
+        return FT_FIFO;
+    case DT_LNK:
+        return FT_LINK;
+    case DT_REG:
+        return FT_REG;
+    case DT_SOCK:
+        return FT_SOCK;
+    case DT_WHT: 
+        return FT_WHITE;
+    default:
+        break;
+    }
+    return FT_UNKOWN;
+}
+
+/* Filetype from st_mode, for when the directory entry
+   doesn't tell us. */
+static Filetype
+get_filetype_mode(mode_t mode)
+{
+    if (S_ISBLK(mode))  return FT_BLOCK;
+    if (S_ISCHR(mode))  return FT_CHAR;
+    if (S_ISDIR(mode))  return FT_DIR;
+    if (S_ISFIFO(mode)) return FT_FIFO;
+    if (S_ISLNK(mode))  return FT_LINK;
+    if (S_ISREG(mode))  return FT_REG;
+    if (S_ISSOCK(mode)) return FT_SOCK;
+    return FT_UNKOWN;
+}
+
+/* Non zero if the active flags print or sort on anything
+   besides the name and type of a file. */
+static int
+need_metadata(void)
+{
+    return f_long_format || output_format == FORMAT_JSON || output_format == FORMAT_CSV 
+        || dump_path != NULL || f_cache || f_du || sort_type == SORT_TIME || sort_type == SORT_SIZE;
+}
+
+/* Non zero if the files are printed as text, which needs widths. */
+static int
+need_widths(void)
+{
+    return output_format == FORMAT_TEXT && dump_path == NULL && !f_du;
+}
+
+/* Executables are only told apart by colour and indicator. */
+static int
+need_exec_check(void)
+{
+    return !f_no_color || !f_no_classify;
+}
+
+static void
+store_longest(Dir_data *dir, File_data *file)
+{
+    int count;
+
+    if (file->nlen > dir->lname)
+        dir->lname = file->nlen;
+    if (file->nlen < dir->sname)
+        dir->sname = file->nlen;
+
+    if (!f_long_format)
+        return;
+    
+    if ((count = count_digits(file->nlink)) > dir->lnlink)
+        dir->lnlink = count;
+
+    if ((count = strlen(file->user)) > dir->luser)
+        dir->luser = count;
+
+    if ((count = strlen(file->group)) > dir->lgroup)
+        dir->lgroup = count;
+
+    if ((count = count_digits(file->fsize)) > dir->lfsize)
+        dir->lfsize = count;
+}
+
+/* Open the directory name relative to the directory fd, 
+   AT_FDCWD for paths given on the command line. */
+static int
+open_dir_at(int fd, const char *name)
+{
+    return openat(fd, name, O_RDONLY | O_DIRECTORY);
+}
+
+/* Match a bracket expression at p against c. Returns the end of the
+   expression, or NULL if it isn't terminated. */
+static const char *
+match_bracket(const char *p, char c, int *matched)
+{
+    int negate = 0;
+    char lo, hi;
+
+    *matched = 0;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        ++p;
+    }
+
+    /* A ']' right after the '[' is taken literally. */
+    do {
+        if (*p == '\0')
+            return NULL;
+
+        lo = hi = *p++;
+        if (lo == '\\' && *p != '\0')
+            lo = hi = *p++;
+
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            hi = p[1];
+            p += 2;
+            if (hi == '\\' && *p != '\0')
+                hi = *p++;
+        }
+
+        if ((unsigned char)c >= (unsigned char)lo 
+        &&  (unsigned char)c <= (unsigned char)hi)
+            *matched = 1;
+    } while (*p != ']');
+
+    *matched ^= negate;
+    return p + 1;
+}
+
+/* Match a shell pattern without recursion, a mismatch after a '*'
+   retries from one character further along the string. */
+static int
+glob_match(const char *p, const char *s)
+{
+    const char *star_p = NULL, *star_s = NULL, *end;
+    int matched;
+
+    while (*s != '\0') {
+        switch (*p)
+        {
+        case '*':
+            while (*p == '*')
+                ++p;
+            if (*p == '\0')
+                return 1;
+            star_p = p;
+            star_s = s;
+            continue;
+
+        case '?':
+            ++p;
+            ++s;
+            continue;
+
+        case '[':
+            if ((end = match_bracket(p + 1, *s, &matched)) == NULL) {
+                matched = *s == '[';
+                end = p + 1;
+            }
+            if (matched) {
+                p = end;
+                ++s;
+                continue;
+            }
+            break;
+
+        case '\\':
+            if (p[1] != '\0')
+                ++p;
+            /* Fallthrough. */
+        default:
+            if (*p == *s) {
+                ++p;
+                ++s;
+                continue;
+            }
+            break;
+        }
+
+        if (star_p == NULL)
+            return 0;
+
+        p = star_p;
+        s = ++star_s;
+    }
+
+    while (*p == '*')
+        ++p;
+    return *p == '\0';
+}
+
+/* Whether name matches pattern. Like fnmatch() with FNM_PERIOD, a 
+   leading '.' has to be matched explicitly. */
+static int
+match_pattern(const Pattern *pattern, const char *name, size_t len)
+{
+    if (name[0] == '.' && pattern->text[0] != '.'
+    &&  !(pattern->text[0] == '\\' && pattern->text[1] == '.'))
+        return 0;
+
+    switch (pattern->type)
+    {
+    case PAT_LITERAL:
+        return len == pattern->len && memcmp(name, pattern->literal, len) == 0;
+
+    case PAT_PREFIX:
+        return len >= pattern->len && memcmp(name, pattern->literal, pattern->len) == 0;
+
+    case PAT_SUFFIX:
+        return len >= pattern->len 
+            && memcmp(name + len - pattern->len, pattern->literal, pattern->len) == 0;
+
+    case PAT_INFIX:
+        return memmem(name, len, pattern->literal, pattern->len) != NULL;
+
+    default:
+        return glob_match(pattern->text, name);
+    }
+}
+
+static int
+match_patterns(const Pattern *patterns, size_t n, const char *name)
+{
+    size_t i, len = strlen(name);
+
+    for (i = 0; i < n; ++i) {
+        if (match_pattern(&patterns[i], name, len))
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether f is a directory, following symlinks. */
+static int
+is_dir(int fd, const char *f)
+{
+    struct stat st;
+
+    if (fstatat(fd, f, &st, 0) == -1) {
+        errno = 0;
+        return 0;
+    }
+    return S_ISDIR(st.st_mode);
+}
+
+/* Name checks and patterns come first, the filesystem is only 
+   asked when -d or -D need to know about a directory d_type 
+   doesn't tell. */
+static int
+ignore_file(int fd, const Dir_entry *de)
+{
+    const char *f = de->name;
+    int isdir;
+
+    if (ignore_files & I_HIDDEN && f[0] == '.')
+        return 1;
+
+    if (ignore_files & I_DOTS && (streq(f, ".") || streq(f, "..")))
+        return 1;
+
+    if (num_ignore > 0 && match_patterns(ignore_patterns, num_ignore, f))
+        return 1;
+
+    /* --hide doesn't apply with -a or -A. */
+    if (num_hide > 0 && ignore_files & I_HIDDEN && !(ignore_files & I_DOTS)
+    &&  match_patterns(hide_patterns, num_hide, f))
+        return 1;
+
+    if (!(ignore_files & (I_DIR | I_REG)))
+        return 0;
+
+    if (de->type != DT_UNKNOWN && de->type != DT_LNK)
+        isdir = de->type == DT_DIR;
+    else
+        isdir = is_dir(fd, f);
+
+    return (ignore_files & I_DIR && isdir) || (ignore_files & I_REG && !isdir);
+}
+
+/* Copy fmt to out with %N replaced by the nanoseconds. */
+static void
+expand_nsec(char *out, size_t size, const char *fmt, long nsec)
+{
+    size_t i = 0;
+
+    for (; *fmt != '\0' && i + 10 < size; ++fmt) {
+        if (fmt[0] == '%' && fmt[1] == 'N') {
+            i += sprintf(out + i, "%09ld", nsec);
+            ++fmt;
+            continue;
+        }
+
+        /* Keep "%%" together so "%%N" stays literal. */
+        if (fmt[0] == '%' && fmt[1] == '%')
+            out[i++] = *fmt++;
+        out[i++] = *fmt;
+    }
+    out[i] = '\0';
+}
+
+/* Format t with the style for its age. The broken-down time is
+   cached per minute, and so is the result when the format doesn't
+   go below minutes. The string is allocated from arena. */
+static const char *
+format_time(Arena *arena, time_t t, long nsec)
+{
+    time_t minute = t - ((t % 60) + 60) % 60;
+    Time_cache *cache = &time_cache[(uint64_t)(minute / 60) & (TIME_CACHE_SIZE - 1)];
+    int recent = t <= now && t > now - SIX_MONTHS;
+    char fmt[TIME_SIZE], buf[TIME_SIZE], *str;
+    struct tm tm;
+    size_t len;
+
+    if (!cache->valid || cache->minute != minute) {
+        if (localtime_r(&minute, &cache->tm) == NULL)
+            return arena_strdup(arena, "?");
+        cache->minute = minute;
+        cache->valid = 1;
+        cache->len[0] = cache->len[1] = 0;
+    }
+
+    if (time_by_minute && cache->len[recent] > 0) {
+        len = cache->len[recent];
+        str = arena_alloc(arena, len + 1);
+        memcpy(str, cache->str[recent], len + 1);
+        return str;
+    }
+
+    tm = cache->tm;
+    tm.tm_sec = t - minute;
+
+    expand_nsec(fmt, sizeof fmt, time_formats[recent], nsec);
+    if ((len = strftime(buf, sizeof buf, fmt, &tm)) == 0)
+        buf[0] = '\0';
+
+    if (time_by_minute) {
+        memcpy(cache->str[recent], buf, len + 1);
+        cache->len[recent] = len;
+    }
+
+    str = arena_alloc(arena, len + 1);
+    memcpy(str, buf, len + 1);
+    return str;
+}
+
+static void
+set_metadata(Arena *arena, File_data *file, struct stat st)
+{
+    if (file->type == FT_UNKOWN)
+        file->type = get_filetype_mode(st.st_mode);
+
+    if (!need_metadata())
+        return;
+
+    file->nlink = st.st_nlink;
+    file->fsize = st.st_size;
+    file->blocks = st.st_blocks;
+    file->ino = st.st_ino;
+
+    switch (time_type)
+    {
+    case TIME_CTIME:
+        file->time = st.st_ctim.tv_sec;
+        file->time_nsec = st.st_ctim.tv_nsec;
+        break;
+
+    case TIME_ATIME:
+        file->time = st.st_atim.tv_sec;
+        file->time_nsec = st.st_atim.tv_nsec;
+        break;
+
+    default:
+        file->time = st.st_mtim.tv_sec;
+        file->time_nsec = st.st_mtim.tv_nsec;
+        break;
+    }
+
+    file->mode = st.st_mode;
+    file->uid = st.st_uid;
+    file->gid = st.st_gid;
+
+    /* Records and dumps have raw numbers, nothing to look up or 
+       format. */
+    if (!need_widths() || !f_long_format)
+        return;
+
+    file->user = get_user_name(arena, st);
+    file->group = get_group_name(arena, st);
+    file->time_str = format_time(arena, file->time, file->time_nsec);
+}
+
+static int
+stat_file(Arena *arena, int dfd, File_data *file)
+{
+    struct stat st;
+
+    if (fstatat(dfd, file->name, &st, stat_flags) == -1) {
+        xerror("failed to stat '%s'", file->name);
+        return 0;
+    }
+    set_metadata(arena, file, st);
+    return 1;
+}
+
+#ifdef __linux__
+/* Each worker sets up its own ring. */
+static __thread Stat_ring *stat_ring = NULL;
+
+/* Set once setting up stat_ring failed. */
+static __thread int stat_ring_failed = 0;
+
+static int
+ring_init(Stat_ring *ring, unsigned int depth)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof p);
+    memset(ring, 0, sizeof(Stat_ring));
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0) {
+        errno = 0;
+        return 0;
+    }
+
+    ring->depth = p.sq_entries;
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_map = ring->sq_map;
+    else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+            goto fail;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        goto fail;
+    }
+
+    sq = ring->sq_map;
+    ring->sq_head  = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+    cq = ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+
+fail:
+    close(ring->fd);
+    errno = 0;
+    return 0;
+}
+
+static void
+ring_free(Stat_ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+static void
+statx_to_stat(const struct statx *sx, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+/* Issue a statx for each of the n files, keeping up to depth 
+   requests in flight. Results are stored in res (0 or -errno) and 
+   sx by index as they complete, in any order. Returns 0 if the ring
+   itself failed, leaving the remaining results at 1. */
+static int
+ring_statx(Stat_ring *ring, int dfd, File_data **files, size_t n,
+           struct statx *sx, int *res)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int tail, head, submit, in_flight = 0;
+    size_t i, next = 0, done = 0;
+
+    for (i = 0; i < n; ++i)
+        res[i] = 1;
+
+    while (done < n) {
+        tail = *ring->sq_tail;
+        for (submit = 0; next < n && in_flight < ring->depth; ++submit, ++in_flight, ++next) {
+            unsigned int idx = tail & *ring->sq_mask;
+
+            sqe = &ring->sqes[idx];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dfd;
+            sqe->statx_flags = stat_flags;
+            sqe->addr = (uintptr_t)files[next]->name;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uintptr_t)&sx[next];
+            sqe->user_data = next;
+            ring->sq_array[idx] = idx;
+            ++tail;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            errno = 0;
+            return 0;
+        }
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            if (cqe->res == -EINVAL)
+                ring->broken = 1;
+            ++head;
+            --in_flight;
+            ++done;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+/* Stat files through stat_ring, anything the ring can't do
+   is left to stat_file(). */
+static int
+stat_files_ring(Arena *arena, int dfd, File_data **files, size_t n)
+{
+    struct statx *sx;
+    struct stat st;
+    size_t i, batch;
+    int *res, ok = 1;
+
+    sx = xmalloc(STAT_BATCH * sizeof(struct statx));
+    res = xmalloc(STAT_BATCH * sizeof(int));
+
+    for (; n > 0 && ok; files += batch, n -= batch) {
+        batch = n < STAT_BATCH ? n : STAT_BATCH;
+
+        if (stat_ring->broken || !ring_statx(stat_ring, dfd, files, batch, sx, res)) {
+            for (i = 0; i < batch; ++i)
+                res[i] = 1;
+        }
+
+        for (i = 0; i < batch && ok; ++i) {
+            if (res[i] != 0) {
+                ok = stat_file(arena, dfd, files[i]);
+                continue;
+            }
+            statx_to_stat(&sx[i], &st);
+            set_metadata(arena, files[i], st);
+        }
+    }
+
+    free(sx);
+    free(res);
+    return ok;
+}
+#endif
+
+static void
+free_stat_ring(void)
+{
+#ifdef __linux__
+    if (stat_ring != NULL) {
+        ring_free(stat_ring);
+        free(stat_ring);
+        stat_ring = NULL;
+    }
+#endif
+}
+
+/* Stat the n files which need it, returns 0 if one of them failed. */
+static int
+stat_files(Arena *arena, int dfd, File_data **files, size_t n)
+{
+    size_t i;
+
+#ifdef __linux__
+    if (f_io_uring && n > 1 && !stat_ring_failed) {
+        if (stat_ring == NULL) {
+            stat_ring = xmalloc(sizeof(Stat_ring));
+            if (!ring_init(stat_ring, queue_depth)) {
+                free(stat_ring);
+                stat_ring = NULL;
+                stat_ring_failed = 1;
+            }
+        }
+        if (stat_ring != NULL)
+            return stat_files_ring(arena, dfd, files, n);
+    }
+#endif
+
+    for (i = 0; i < n; ++i) {
+        if (!stat_file(arena, dfd, files[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Start reading the directory open on fd, the reader owns fd. */
+static int
+reader_open(Dir_reader *reader, int fd)
+{
+    reader->d = NULL;
+    reader->fd = fd;
+    reader->buf = NULL;
+    reader->pos = reader->len = 0;
+
+#ifdef __linux__
+    if (f_getdents) {
+        reader->buf_size = dir_buffer_size;
+        reader->buf = xmalloc(reader->buf_size);
+        return 1;
+    }
+#endif
+
+    if ((reader->d = fdopendir(fd)) == NULL) {
+        close(fd);
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns 0 at the end of the directory, or on error
+   with errno set. */
+static int
+reader_next(Dir_reader *reader, Dir_entry *entry)
+{
+    struct dirent *de;
+
+#ifdef __linux__
+    if (reader->buf != NULL) {
+        struct linux_dirent64 *de64;
+        long len;
+
+        if (reader->pos >= reader->len) {
+            len = syscall(SYS_getdents64, reader->fd, reader->buf, reader->buf_size);
+            if (len <= 0)
+                return 0;
+
+            reader->len = len;
+            reader->pos = 0;
+        }
+
+        de64 = (struct linux_dirent64 *)(reader->buf + reader->pos);
+        reader->pos += de64->d_reclen;
+        entry->name = de64->d_name;
+        entry->type = de64->d_type;
+        return 1;
+    }
+#endif
+
+    if ((de = readdir(reader->d)) == NULL)
+        return 0;
+
+    entry->name = de->d_name;
+    entry->type = de->d_type;
+    return 1;
+}
+
+/* Drop the read buffer, the fd stays open. */
+static void
+reader_done(Dir_reader *reader)
+{
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+static int
+reader_fd(Dir_reader *reader)
+{
+    return reader->d != NULL ? dirfd(reader->d) : reader->fd;
+}
+
+static void
+reader_close(Dir_reader *reader)
+{
+    if (reader->d != NULL)
+        closedir(reader->d);
+    else
+        close(reader->fd);
+
+    free(reader->buf);
+}
+
+static File_data *
+new_file(Arena *arena, const Dir_entry *de)
+{
+    File_data *file;
+
+    file = arena_alloc(arena, sizeof(File_data));
+    file->name = arena_strdup(arena, de->name);
+    file->type = get_filetype(de->type);
+    file->nlen = strlen(de->name);
+    file->mode = 0;
+    file->user = file->group = NULL;
+    file->uid = 0;
+    file->gid = 0;
+    file->nlink = 0;
+    file->ino = 0;
+    file->fsize = 0;
+    file->time = 0;
+    file->time_nsec = 0;
+    file->time_str = NULL;
+
+    return file;
+}
+
+static void
+set_indicator(File_data *file)
+{
+    file->indicator = get_indicator(file->type);
+
+    /* Width on screen. */
+    if (file->indicator != 0 && !f_no_classify)
+        file->nlen++;
+}
+
+/* Set the indicator of a stat'ed file. */
+static void
+classify_file(int dfd, File_data *file)
+{
+    if (need_exec_check() 
+    &&  file->type != FT_DIR
+    &&  faccessat(dfd, file->name, X_OK, 0) == 0)
+        file->type = FT_EXEC;
+    else
+        errno = 0; /* Permission denied. */
+
+    set_indicator(file);
+}
+
+/* Size of an entry in each column of a dump. */
+static const size_t column_sizes[NUM_COLUMNS] = {
+    sizeof(uint64_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+    sizeof(int64_t),  sizeof(int64_t),  sizeof(int64_t),  sizeof(uint32_t), 
+    sizeof(uint32_t), sizeof(uint64_t), sizeof(uint8_t)
+};
+
+#define DUMP_ALIGN(offset) (((offset) + 7) & ~(uint64_t)7)
+
+static void
+dump_close(Dump_writer *writer)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_COLUMNS; ++i) {
+        if (writer->columns[i] != NULL)
+            fclose(writer->columns[i]);
+    }
+    if (writer->dirs != NULL)
+        fclose(writer->dirs);
+    if (writer->heap != NULL)
+        fclose(writer->heap);
+    free(writer->path);
+}
+
+static void
+dump_put(Dump_writer *writer, FILE *section, const void *data, size_t size)
+{
+    if (fwrite(data, size, 1, section) != 1)
+        writer->failed = 1;
+}
+
+/* Add str to the heap, returns its offset. */
+static uint64_t
+dump_string(Dump_writer *writer, const char *str)
+{
+    uint64_t offset = writer->heap_size;
+    size_t len = strlen(str) + 1;
+
+    dump_put(writer, writer->heap, str, len);
+    writer->heap_size += len;
+    return offset;
+}
+
+/* Spool every section of a dump to path to a temporary file. */
+static int
+dump_start(Dump_writer *writer, const char *path)
+{
+    size_t i;
+    int failed = 0;
+
+    memset(writer, 0, sizeof(Dump_writer));
+    writer->path = dupstr(path);
+
+    for (i = 0; i < NUM_COLUMNS; ++i)
+        failed |= (writer->columns[i] = tmpfile()) == NULL;
+    failed |= (writer->dirs = tmpfile()) == NULL;
+    failed |= (writer->heap = tmpfile()) == NULL;
+
+    if (failed) {
+        xerror("failed to create temporary files for '%s'", path);
+        dump_close(writer);
+        return 0;
+    }
+
+    /* Offset 0 is the empty string. */
+    dump_string(writer, "");
+    return 1;
+}
+
+/* Store the fields of file in row idx of columns, name is the 
+   offset of its name in the heap. */
+static void
+dump_row(char **columns, size_t idx, const File_data *file, uint64_t name)
+{
+    uint64_t ino = file->ino;
+    uint32_t mode = file->mode, uid = file->uid, gid = file->gid, 
+             nsec = file->time_nsec, nlink = file->nlink;
+    int64_t size = file->fsize, blocks = file->blocks, time = file->time;
+    uint8_t type = file->type;
+
+    memcpy(columns[COL_INO] + idx * sizeof ino, &ino, sizeof ino);
+    memcpy(columns[COL_MODE] + idx * sizeof mode, &mode, sizeof mode);
+    memcpy(columns[COL_UID] + idx * sizeof uid, &uid, sizeof uid);
+    memcpy(columns[COL_GID] + idx * sizeof gid, &gid, sizeof gid);
+    memcpy(columns[COL_SIZE] + idx * sizeof size, &size, sizeof size);
+    memcpy(columns[COL_BLOCKS] + idx * sizeof blocks, &blocks, sizeof blocks);
+    memcpy(columns[COL_TIME] + idx * sizeof time, &time, sizeof time);
+    memcpy(columns[COL_TIME_NSEC] + idx * sizeof nsec, &nsec, sizeof nsec);
+    memcpy(columns[COL_NLINK] + idx * sizeof nlink, &nlink, sizeof nlink);
+    memcpy(columns[COL_NAME] + idx * sizeof name, &name, sizeof name);
+    memcpy(columns[COL_TYPE] + idx * sizeof type, &type, sizeof type);
+}
+
+static void
+dump_file(Dump_writer *writer, const File_data *file)
+{
+    char row[NUM_COLUMNS][sizeof(uint64_t)], *columns[NUM_COLUMNS];
+    size_t i;
+
+    for (i = 0; i < NUM_COLUMNS; ++i)
+        columns[i] = row[i];
+    dump_row(columns, 0, file, dump_string(writer, file->name));
+
+    for (i = 0; i < NUM_COLUMNS; ++i)
+        dump_put(writer, writer->columns[i], row[i], column_sizes[i]);
+    writer->num_files++;
+}
+
+/* Close off the directory at path, holding the files dumped since 
+   first. */
+static void
+dump_dir_end(Dump_writer *writer, const char *path, uint64_t first)
+{
+    Dump_dir dir;
+
+    dir.path = dump_string(writer, path);
+    dir.first = first;
+    dir.count = writer->num_files - first;
+    dump_put(writer, writer->dirs, &dir, sizeof dir);
+    writer->num_dirs++;
+}
+
+static void
+dump_dir(Dump_writer *writer, const Dir_data *dir)
+{
+    uint64_t first = writer->num_files;
+    size_t i;
+
+    for (i = 0; i < dir->num_files; ++i)
+        dump_file(writer, dir->files[i]);
+    dump_dir_end(writer, dir->path, first);
+}
+
+/* Append section to out, zero padded to start at offset. */
+static void
+dump_copy(Dump_writer *writer, FILE *out, uint64_t *pos, uint64_t offset, FILE *section)
+{
+    char buf[64 * 1024];
+    size_t len;
+
+    memset(buf, 0, 8);
+    if (offset > *pos)
+        dump_put(writer, out, buf, offset - *pos);
+
+    rewind(section);
+    while ((len = fread(buf, 1, sizeof buf, section)) > 0) {
+        dump_put(writer, out, buf, len);
+        offset += len;
+    }
+    if (ferror(section))
+        writer->failed = 1;
+    *pos = offset;
+}
+
+/* Fill in header for a dump of the given size, with the sections
+   laid out behind it. */
+static void
+dump_layout(Dump_header *header, uint64_t num_files, uint64_t num_dirs, uint64_t heap_size)
+{
+    uint64_t offset = sizeof(Dump_header);
+    size_t i;
+
+    memset(header, 0, sizeof(Dump_header));
+    header->magic = DUMP_MAGIC;
+    header->version = DUMP_VERSION;
+    header->num_files = num_files;
+    header->num_dirs = num_dirs;
+    header->time_type = time_type;
+
+    for (i = 0; i < NUM_COLUMNS; ++i) {
+        header->columns[i] = offset = DUMP_ALIGN(offset);
+        offset += num_files * column_sizes[i];
+    }
+    header->dirs = offset = DUMP_ALIGN(offset);
+    offset += num_dirs * sizeof(Dump_dir);
+    header->heap = offset = DUMP_ALIGN(offset);
+    header->heap_size = heap_size;
+    header->size = offset + heap_size;
+}
+
+/* Write the sections behind the header to a temporary file, which
+   is moved in place once complete. */
+static int
+dump_finish(Dump_writer *writer)
+{
+    Dump_header header;
+    uint64_t pos;
+    char *tmp;
+    size_t i;
+    FILE *out;
+    int fd;
+
+    dump_layout(&header, writer->num_files, writer->num_dirs, writer->heap_size);
+    header.flags = f_recursive ? DUMP_RECURSIVE : 0;
+
+    tmp = xmalloc(strlen(writer->path) + 8);
+    sprintf(tmp, "%s.XXXXXX", writer->path);
+
+    if ((fd = mkstemp(tmp)) == -1 || (out = fdopen(fd, "w")) == NULL) {
+        xerror("failed to write '%s'", writer->path);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        dump_close(writer);
+        return 0;
+    }
+
+    pos = sizeof header;
+    dump_put(writer, out, &header, sizeof header);
+    for (i = 0; i < NUM_COLUMNS; ++i)
+        dump_copy(writer, out, &pos, header.columns[i], writer->columns[i]);
+    dump_copy(writer, out, &pos, header.dirs, writer->dirs);
+    dump_copy(writer, out, &pos, header.heap, writer->heap);
+
+    if (fchmod(fd, 0644) == -1)
+        writer->failed = 1;
+    if (fclose(out) == EOF || writer->failed || rename(tmp, writer->path) == -1) {
+        xerror("failed to write '%s'", writer->path);
+        unlink(tmp);
+        writer->failed = 1;
+    }
+
+    free(tmp);
+    dump_close(writer);
+    return !writer->failed;
+}
+
+/* Non zero if count entries of size starting at offset are within
+   the dump described by header. */
+static int
+dump_section(const Dump_header *header, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset % 8 == 0 && offset >= sizeof(Dump_header) && offset <= header->size
+        && count <= (header->size - offset) / size;
+}
+
+/* Map the dump at path and check that its sections are in bounds. */
+static int
+dump_map(Dump *dump, const char *path)
+{
+    const Dump_header *header;
+    struct stat st;
+    size_t i;
+    int fd, valid;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return 0;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Dump_header)) {
+        close(fd);
+        return 0;
+    }
+
+    dump->size = st.st_size;
+    dump->map = mmap(NULL, dump->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (dump->map == MAP_FAILED)
+        return 0;
+
+    header = dump->header = dump->map;
+    valid = header->magic == DUMP_MAGIC && header->version == DUMP_VERSION
+         && header->size == dump->size && header->time_type <= TIME_ATIME
+         && header->heap_size > 0
+         && dump_section(header, header->heap, header->heap_size, 1)
+         && dump_section(header, header->dirs, header->num_dirs, sizeof(Dump_dir));
+
+    for (i = 0; valid && i < NUM_COLUMNS; ++i) {
+        valid = dump_section(header, header->columns[i], header->num_files, column_sizes[i]);
+        dump->columns[i] = (const char *)dump->map + header->columns[i];
+    }
+
+    if (valid) {
+        dump->dirs = (const Dump_dir *)((const char *)dump->map + header->dirs);
+        dump->heap = (const char *)dump->map + header->heap;
+
+        /* Every string in the heap is terminated. */
+        valid = dump->heap[header->heap_size - 1] == '\0';
+    }
+
+    if (!valid) {
+        munmap(dump->map, dump->size);
+        errno = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Build the directory described by entry. Names point into the 
+   mapped heap. With subdirs set the subdirectories are left in 
+   sub_names, in the order they were read. Returns NULL if entry is
+   out of bounds. */
+static Dir_data *
+load_dir(const Dump *dump, const Dump_dir *entry, int subdirs)
+{
+    const Dump_header *header = dump->header;
+    Dir_data *dir;
+    File_data *file;
+    struct stat st;
+    uint64_t name, idx;
+    size_t i;
+
+    if (entry->path >= header->heap_size || entry->first > header->num_files
+    ||  entry->count > header->num_files - entry->first)
+        return NULL;
+
+    dir = new_dir();
+    dir->path = arena_strdup(&dir->arena, dump->heap + entry->path);
+    dir->files_size = entry->count + 1;
+    dir->files = xmalloc(dir->files_size * sizeof(File_data *));
+
+    for (i = 0; i < entry->count; ++i) {
+        idx = entry->first + i;
+        name = ((const uint64_t *)dump->columns[COL_NAME])[idx];
+        if (name >= header->heap_size) {
+            free_dir(dir);
+            return NULL;
+        }
+
+        file = arena_alloc(&dir->arena, sizeof(File_data));
+        memset(file, 0, sizeof(File_data));
+        file->name = (char *)dump->heap + name;
+        file->nlen = strlen(file->name);
+        file->type = ((const uint8_t *)dump->columns[COL_TYPE])[idx];
+        if (file->type > FT_UNKOWN)
+            file->type = FT_UNKOWN;
+
+        /* The stored time stands in for whichever --time asks for. */
+        memset(&st, 0, sizeof st);
+        st.st_ino = ((const uint64_t *)dump->columns[COL_INO])[idx];
+        st.st_mode = ((const uint32_t *)dump->columns[COL_MODE])[idx];
+        st.st_uid = ((const uint32_t *)dump->columns[COL_UID])[idx];
+        st.st_gid = ((const uint32_t *)dump->columns[COL_GID])[idx];
+        st.st_size = ((const int64_t *)dump->columns[COL_SIZE])[idx];
+        st.st_blocks = ((const int64_t *)dump->columns[COL_BLOCKS])[idx];
+        st.st_nlink = ((const uint32_t *)dump->columns[COL_NLINK])[idx];
+        st.st_mtim.tv_sec = ((const int64_t *)dump->columns[COL_TIME])[idx];
+        st.st_mtim.tv_nsec = ((const uint32_t *)dump->columns[COL_TIME_NSEC])[idx];
+        st.st_atim = st.st_ctim = st.st_mtim;
+
+        set_metadata(&dir->arena, file, st);
+        set_indicator(file);
+        if (need_widths())
+            store_longest(dir, file);
+        dir->files[i] = file;
+    }
+
+    dir->files[i] = NULL;
+
+    if (subdirs) {
+        dir->sub_names = arena_alloc(&dir->arena, (i + 1) * sizeof(char *));
+        for (i = 0; i < entry->count; ++i) {
+            file = dir->files[i];
+            if (file->type == FT_DIR && !streq(file->name, ".") && !streq(file->name, ".."))
+                dir->sub_names[dir->num_subdirs++] = file->name;
+        }
+    }
+
+    if (!f_unsorted)
+        sort_files(&dir->arena, dir->files, entry->count);
+    dir->num_files = entry->count;
+    return dir;
+}
+
+/* Hash of everything besides the directory itself that decides on
+   the entries of a cached listing and their type. */
+static uint64_t
+hash_options(void)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int values[4];
+    size_t i, j;
+    const char *p;
+
+    values[0] = ignore_files;
+    values[1] = time_type;
+    values[2] = need_exec_check();
+    values[3] = stat_flags;
+
+    /* FNV-1a over the values and the patterns, a pattern ends in
+       '\0' and the lists in '\1'. */
+    for (p = (const char *)values; p < (const char *)(values + 4); ++p)
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+
+    for (i = 0; i < 2; ++i) {
+        const Pattern *patterns = i == 0 ? ignore_patterns : hide_patterns;
+        size_t n = i == 0 ? num_ignore : num_hide;
+
+        for (j = 0; j < n; ++j) {
+            for (p = patterns[j].text; ; ++p) {
+                hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+                if (*p == '\0')
+                    break;
+            }
+        }
+        hash = (hash ^ 1) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Set up ~/.xutils/lscache, turns --cache off without a home. */
+static void
+cache_init(void)
+{
+    char *home = getenv("HOME");
+
+    if (home == NULL || *home == '\0') {
+        f_cache = 0;
+        return;
+    }
+
+    cache_dir = xmalloc(strlen(home) + sizeof("/.xutils/lscache"));
+    sprintf(cache_dir, "%s/.xutils", home);
+    mkdir(cache_dir, 0755);
+
+    /* Listings show what's in directories other users may not be
+       allowed to read, so they're kept private. */
+    strcat(cache_dir, "/lscache");
+    mkdir(cache_dir, 0700);
+    chmod(cache_dir, 0700);
+    errno = 0;
+
+    cache_options = hash_options();
+}
+
+/* Cached listings are named after the device and inode. */
+static char *
+cache_path(const struct stat *st)
+{
+    char *path = xmalloc(strlen(cache_dir) + 40);
+
+    sprintf(path, "%s/%llx-%llx", cache_dir, 
+            (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return path;
+}
+
+static void
+cache_source(Dump_source *source, const struct stat *st)
+{
+    source->dev = st->st_dev;
+    source->ino = st->st_ino;
+    source->mtime_sec = st->st_mtim.tv_sec;
+    source->mtime_nsec = st->st_mtim.tv_nsec;
+    source->ctime_sec = st->st_ctim.tv_sec;
+    source->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/* Whether the listing behind header can stand in for the directory
+   with identity source. */
+static int
+cache_fresh(const Dump_header *header, const Dump_source *source)
+{
+    const Dump_source *cached = &header->source;
+
+    if (header->num_dirs != 1 || header->options != cache_options
+    ||  header->time_type != time_type
+    ||  cached->dev != source->dev || cached->ino != source->ino
+    ||  cached->mtime_sec != source->mtime_sec 
+    ||  cached->mtime_nsec != source->mtime_nsec)
+        return 0;
+
+    /* Changes made in the second the listing was written may not 
+       have moved the mtime. */
+    if (header->written <= source->mtime_sec)
+        return 0;
+
+    if (cached->ctime_sec == source->ctime_sec && cached->ctime_nsec == source->ctime_nsec)
+        return 1;
+
+    return cache_ttl > 0 && now - header->written <= cache_ttl;
+}
+
+/* The cached listing of the directory with stat st, NULL if there
+   is none or it's out of date. */
+static Dir_data *
+cache_load(const struct stat *st, const char *path)
+{
+    Dump dump;
+    Dump_source source;
+    Dir_data *dir = NULL;
+    char *file = cache_path(st);
+
+    if (!dump_map(&dump, file)) {
+        errno = 0;
+        free(file);
+        return NULL;
+    }
+    free(file);
+
+    cache_source(&source, st);
+    if (cache_fresh(dump.header, &source))
+        dir = load_dir(&dump, &dump.dirs[0], f_recursive);
+
+    if (dir == NULL) {
+        munmap(dump.map, dump.size);
+        return NULL;
+    }
+
+    dir->path = arena_strdup(&dir->arena, path);
+    dir->map = dump.map;
+    dir->map_size = dump.size;
+    return dir;
+}
+
+/* Write the first n files of dir, read from the directory with stat
+   st, to the cache. Failing to is not an error. */
+static void
+cache_store(const Dir_data *dir, size_t n, const struct stat *st)
+{
+    Dump_header header;
+    Dump_dir entry;
+    char *columns[NUM_COLUMNS], *heap, *path, *tmp;
+    size_t i, heap_size, len;
+    int fd, failed = 0;
+
+    heap_size = 1 + strlen(dir->path) + 1;
+    for (i = 0; i < n; ++i)
+        heap_size += strlen(dir->files[i]->name) + 1;
+
+    dump_layout(&header, n, 1, heap_size);
+    cache_source(&header.source, st);
+    header.options = cache_options;
+    header.written = time(NULL);
+
+    heap = xmalloc(heap_size);
+    heap[0] = '\0';
+    heap_size = 1;
+    for (i = 0; i < NUM_COLUMNS; ++i)
+        columns[i] = xmalloc(n * column_sizes[i] + 1);
+
+    for (i = 0; i < n; ++i) {
+        len = strlen(dir->files[i]->name) + 1;
+        memcpy(heap + heap_size, dir->files[i]->name, len);
+        dump_row(columns, i, dir->files[i], heap_size);
+        heap_size += len;
+    }
+
+    entry.path = heap_size;
+    entry.first = 0;
+    entry.count = n;
+    memcpy(heap + heap_size, dir->path, strlen(dir->path) + 1);
+
+    path = cache_path(st);
+    tmp = xmalloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    /* mkstemp() leaves it readable by us alone. */
+    if ((fd = mkstemp(tmp)) != -1) {
+        failed |= pwrite(fd, &header, sizeof header, 0) != sizeof header;
+        for (i = 0; i < NUM_COLUMNS; ++i) {
+            len = n * column_sizes[i];
+            failed |= pwrite(fd, columns[i], len, header.columns[i]) != (ssize_t)len;
+        }
+        failed |= pwrite(fd, &entry, sizeof entry, header.dirs) != sizeof entry;
+        failed |= pwrite(fd, heap, header.heap_size, header.heap) != (ssize_t)header.heap_size;
+        failed |= close(fd) == -1;
+
+        if (failed || rename(tmp, path) == -1)
+            unlink(tmp);
+    }
+
+    errno = 0;
+    for (i = 0; i < NUM_COLUMNS; ++i)
+        free(columns[i]);
+    free(heap);
+    free(path);
+    free(tmp);
+}
+
+/* Print the entries of reader in directory order, a chunk at a 
+   time, without keeping them around. Only the names of the 
+   subdirectories are kept for -R. */
+static Dir_data *
+list_unsorted(Dir_reader *reader, const char *path)
+{
+    size_t i, n, num_stat, size_subs = 0;
+    int dfd;
+    char **subs = NULL;
+    Arena chunk;
+    Dir_entry de;
+    Dir_data *dir;
+    File_data *files[UNSORTED_CHUNK + 1], *need_stat[UNSORTED_CHUNK];
+    uint64_t first = dump_writer.num_files;
+
+    dfd = reader_fd(reader);
+    dir = new_dir();
+    dir->path = arena_strdup(&dir->arena, path);
+    dir->files = files;
+    dir->lnlink = UNSORTED_NLINK;
+    dir->luser = dir->lgroup = UNSORTED_USER;
+    dir->lfsize = f_human_readable ? 7 : UNSORTED_SIZE;
+
+    if (need_widths() && num_printed++ > 0)
+        out_char('\n');
+
+    if (need_widths() && unsorted_headers) {
+        out_puts(path);
+        out_write(": \n", 3);
+    }
+
+    for (;;) {
+        arena_init(&chunk);
+
+        errno = 0;
+        for (n = 0; n < UNSORTED_CHUNK && reader_next(reader, &de);) {
+            if (!ignore_file(dfd, &de))
+                files[n++] = new_file(&chunk, &de);
+        }
+
+        /* What was read before the error is still listed. */
+        if (errno != 0) {
+            xerror("an error occured while reading '%s'", path);
+            dir->failed = 1;
+        }
+
+        if (n == 0) {
+            arena_free(&chunk);
+            break;
+        }
+
+        for (i = num_stat = 0; i < n; ++i) {
+            if (need_metadata() || files[i]->type == FT_UNKOWN)
+                need_stat[num_stat++] = files[i];
+        }
+
+        if (!stat_files(&chunk, dfd, need_stat, num_stat)) {
+            dir->failed = 1;
+            arena_free(&chunk);
+            break;
+        }
+
+        for (i = 0; i < n; ++i) {
+            classify_file(dfd, files[i]);
+            if (dump_path != NULL)
+                dump_file(&dump_writer, files[i]);
+            else
+            if (output_format == FORMAT_TEXT)
+                print_file(dir, files[i]);
+            else
+                print_record(dir, files[i], unsorted_headers);
+
+            if (files[i]->type == FT_DIR && f_recursive 
+            &&  !streq(files[i]->name, ".") && !streq(files[i]->name, "..")) {
+                if (dir->num_subdirs == size_subs) {
+                    size_subs = size_subs ? size_subs * 2 : 16;
+                    subs = xrealloc(subs, size_subs * sizeof(char *));
+                }
+                subs[dir->num_subdirs++] = arena_strdup(&dir->arena, files[i]->name);
+            }
+        }
+
+        arena_free(&chunk);
+        if (dir->failed)
+            break;
+    }
+
+    reader_done(reader);
+
+    if (dump_path != NULL)
+        dump_dir_end(&dump_writer, path, first);
+
+    if (f_recursive && need_widths())
+        out_char('\n');
+
+    if (subs != NULL) {
+        dir->sub_names = arena_alloc(&dir->arena, dir->num_subdirs * sizeof(char *));
+        memcpy(dir->sub_names, subs, dir->num_subdirs * sizeof(char *));
+        free(subs);
+    }
+
+    dir->files = NULL;
+    return dir;
+}
+
+/* Adds dev and ino to set, non zero if they weren't in it yet. */
+static int
+id_set_add(Id_set *set, uint64_t dev, uint64_t ino)
+{
+    File_id *old;
+    size_t i, j, old_size;
+
+    /* Keep it at most half full. */
+    if (2 * (set->count + 1) > set->size) {
+        old = set->ids;
+        old_size = set->size;
+        set->size = set->size ? set->size * 2 : 1024;
+        set->ids = xmalloc(set->size * sizeof(File_id));
+        memset(set->ids, 0, set->size * sizeof(File_id));
+
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].ino == 0)
+                continue;
+            j = (old[i].ino ^ old[i].dev * 0x9e3779b97f4a7c15ULL) & (set->size - 1);
+            while (set->ids[j].ino != 0)
+                j = (j + 1) & (set->size - 1);
+            set->ids[j] = old[i];
+        }
+        free(old);
+    }
+
+    i = (ino ^ dev * 0x9e3779b97f4a7c15ULL) & (set->size - 1);
+    for (; set->ids[i].ino != 0; i = (i + 1) & (set->size - 1)) {
+        if (set->ids[i].ino == ino && set->ids[i].dev == dev)
+            return 0;
+    }
+
+    if (ino != 0) {
+        set->ids[i].dev = dev;
+        set->ids[i].ino = ino;
+        ++set->count;
+    }
+    return 1;
+}
+
+static void
+id_set_clear(Id_set *set)
+{
+    if (set->count > 0)
+        memset(set->ids, 0, set->size * sizeof(File_id));
+    set->count = 0;
+}
+
+/* Add up the size of the directory open at dfd and of the files in
+   it for --du, and keep the files with more than one link apart.
+   Subdirectories add up their own. */
+static void
+du_sum(Dir_data *dir, int dfd)
+{
+    struct stat st;
+    File_data *file;
+    Du_link *link;
+    size_t i, n = 0;
+
+    if (fstat(dfd, &st) == -1)
+        memset(&st, 0, sizeof st);
+
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->apparent = st.st_size;
+    dir->allocated = (uint64_t)st.st_blocks * 512;
+
+    for (i = 0; i < dir->num_files; ++i) {
+        file = dir->files[i];
+        if (file->type == FT_DIR)
+            continue;
+
+        if (file->nlink > 1) {
+            ++n;
+            continue;
+        }
+        dir->apparent += file->fsize;
+        dir->allocated += (uint64_t)file->blocks * 512;
+    }
+
+    if (n == 0)
+        return;
+
+    dir->links = arena_alloc(&dir->arena, n * sizeof(Du_link));
+    for (i = 0; i < dir->num_files; ++i) {
+        file = dir->files[i];
+        if (file->type == FT_DIR || file->nlink <= 1)
+            continue;
+
+        /* Everything in a directory is on its device, but for 
+           mount points, which are directories. */
+        link = &dir->links[dir->num_links++];
+        link->dev = st.st_dev;
+        link->ino = file->ino;
+        link->apparent = file->fsize;
+        link->allocated = (uint64_t)file->blocks * 512;
+    }
+}
+
+/* Read the directory open in reader, path is only used for 
+   printing and is copied. Subdirectories to descend into are
+   left in sub_names. The listing is cached when st, the stat of
+   the directory, is given. */
+static Dir_data *
+get_files(Dir_reader *reader, const char *path, const struct stat *st)
+{
+    size_t i, n, num_stat;
+    int dfd, read_failed;
+    Dir_entry de;
+    Dir_data *dir;
+    File_data *file, **need_stat;
+
+    dfd = reader_fd(reader);
+    dir = new_dir();
+    dir->files_size = 64;
+    dir->files = xmalloc(dir->files_size * sizeof(File_data *));
+
+    errno = 0;
+    for (i = 0; reader_next(reader, &de); ++i) {
+        if (ignore_file(dfd, &de)) {
+            --i;
+            continue;
+        }
+
+        /* Room for the entry and a terminating NULL. */
+        if (i + 2 > dir->files_size) {
+            dir->files_size *= 2;
+            dir->files = xrealloc(dir->files, dir->files_size * sizeof(File_data *));
+        }
+
+        dir->files[i] = new_file(&dir->arena, &de);
+    }
+
+    read_failed = errno != 0;
+    if (read_failed)
+        xerror("an error occured while reading '%s'", path);
+
+    reader_done(reader);
+    n = i;
+
+    /* Short listings get by with the directory entry alone,
+       unless the filesystem doesn't fill in d_type. */
+    need_stat = xmalloc((n + 1) * sizeof(File_data *));
+    for (i = num_stat = 0; i < n; ++i) {
+        if (need_metadata() || dir->files[i]->type == FT_UNKOWN)
+            need_stat[num_stat++] = dir->files[i];
+    }
+
+    if (!stat_files(&dir->arena, dfd, need_stat, num_stat)) {
+        free(need_stat);
+        free_dir(dir);
+        return NULL;
+    }
+    free(need_stat);
+
+    if (f_recursive)
+        dir->sub_names = arena_alloc(&dir->arena, (n + 1) * sizeof(char *));
+
+    for (i = 0; i < n; ++i) {
+        file = dir->files[i];
+        classify_file(dfd, file);
+
+        if (need_widths())
+            store_longest(dir, file);
+
+        if (file->type == FT_DIR && f_recursive 
+        &&  !streq(file->name, ".") && !streq(file->name, ".."))
+            dir->sub_names[dir->num_subdirs++] = file->name;
+    }
+
+    dir->path = arena_strdup(&dir->arena, path);
+    dir->files[i] = NULL;
+    dir->failed = read_failed;
+
+    /* In the order they were read, like sub_names. A partial 
+       listing would look fresh as long as the directory is 
+       unchanged. */
+    if (st != NULL && !read_failed)
+        cache_store(dir, i, st);
+
+    /* Only the sums are printed with --du. */
+    if (!f_du)
+        sort_files(&dir->arena, dir->files, i);
+    dir->num_files = i;
+
+    return dir;
+}
+
+static Task *
+new_task(Dir_ref *parent, const char *name, const char *path)
+{
+    Task *task = xmalloc(sizeof(Task));
+
+    task->parent = parent;
+    task->name = dupstr(name);
+    task->slot = xmalloc(sizeof(Slot));
+    task->slot->dir = NULL;
+    task->slot->taken = task->slot->done = 0;
+    task->slot->root = parent == NULL;
+
+    if (path == NULL)
+        task->path = dupstr(name);
+    else {
+        task->path = xmalloc(strlen(path) + strlen(name) + 2);
+        sprintf(task->path, "%s/%s", path, name);
+    }
+    return task;
+}
+
+static void
+free_task(Task *task)
+{
+    free(task->name);
+    free(task->path);
+    free(task);
+}
+
+static void
+release_dir_ref(Dir_ref *ref)
+{
+    if (__atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    reader_close(&ref->reader);
+    free(ref);
+}
+
+static void
+push_task(Worker *worker, Task *task)
+{
+    Deque *deque = &worker->deque;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->size) {
+        deque->size = deque->size ? deque->size * 2 : 64;
+        deque->tasks = xrealloc(deque->tasks, deque->size * sizeof(Task *));
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&pool_lock);
+    ++pending;
+    ++queued;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Take a task from our own deque, or steal the oldest one of
+   another worker. */
+static Task *
+take_task(Worker *worker)
+{
+    Task *task = NULL;
+    Deque *deque;
+    size_t i;
+
+    for (i = 0; i < num_jobs && task == NULL; ++i) {
+        deque = &workers[(worker->id + i) % num_jobs].deque;
+
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head < deque->tail) {
+            if (i == 0)
+                task = deque->tasks[--deque->tail];
+            else
+                task = deque->tasks[deque->head++];
+
+            if (deque->head == deque->tail)
+                deque->head = deque->tail = 0;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    if (task != NULL) {
+        pthread_mutex_lock(&pool_lock);
+        --queued;
+        task->slot->taken = 1;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return task;
+}
+
+/* Take the task reading slot out of whichever deque it's in, NULL
+   if it's not queued. */
+static Task *
+take_slot_task(Slot *slot)
+{
+    Task *task = NULL;
+    Deque *deque;
+    size_t i, j;
+
+    for (i = 0; i < num_jobs && task == NULL; ++i) {
+        deque = &workers[i].deque;
+
+        /* Subdirectories are printed last queued first. */
+        pthread_mutex_lock(&deque->lock);
+        for (j = deque->tail; j > deque->head; --j) {
+            if (deque->tasks[j - 1]->slot != slot)
+                continue;
+
+            task = deque->tasks[j - 1];
+            memmove(deque->tasks + j - 1, deque->tasks + j, 
+                    (deque->tail - j) * sizeof(Task *));
+            if (--deque->tail == deque->head)
+                deque->head = deque->tail = 0;
+            break;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    if (task != NULL) {
+        pthread_mutex_lock(&pool_lock);
+        --queued;
+        slot->taken = 1;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return task;
+}
+
+/* Read the directory of task and queue its subdirectories,
+   sharing the directory fd between them. */
 static Dir_data *
-get_files(const char *path)
+run_task(Worker *worker, Task *task)
 {
-    const size_t ALLOC = 25;
-    size_t i, j, path_len, 
-           row_len = 0;
-    DIR *d;
-    char *fpath;
-    struct dirent *de;
-    struct stat st;
-    struct winsize w;
+    Task *sub;
+    Dir_ref *ref;
     Dir_data *dir;
+    struct stat st;
+    size_t i;
+    int fd, cached;
 
-    if ((d = opendir(path)) == NULL) {
-        xerror("Failed to read '%s'", path);
-        return 0;
+    fd = open_dir_at(task->parent ? reader_fd(&task->parent->reader) : AT_FDCWD, task->name);
+    if (task->parent != NULL)
+        release_dir_ref(task->parent);
+
+    if (fd == -1) {
+        xerror("Failed to read '%s'", task->path);
+        return NULL;
     }
 
-    dir = new_dir();
-    dir->files = xmalloc(ALLOC * sizeof(File_data *));
+    ref = xmalloc(sizeof(Dir_ref));
+    if (!reader_open(&ref->reader, fd)) {
+        xerror("Failed to read '%s'", task->path);
+        free(ref);
+        return NULL;
+    }
 
-    path_len = strlen(path);
-    ioctl(0, TIOCGWINSZ, &w);
-    window_width = w.ws_col;
+    /* -U prints while reading, there's no listing to cache. */
+    cached = f_cache && !f_unsorted && fstat(fd, &st) == 0;
+    dir = cached ? cache_load(&st, task->path) : NULL;
 
-    for (i = 0, j = 1; (de = readdir(d)) != NULL; ++i) {
-        if (ignore_file(de->d_name)) {
-            --i;
+    if (dir == NULL && f_unsorted)
+        dir = list_unsorted(&ref->reader, task->path);
+    else
+    if (dir == NULL)
+        dir = get_files(&ref->reader, task->path, cached ? &st : NULL);
+
+    if (dir != NULL && f_du)
+        du_sum(dir, fd);
+
+    if (dir == NULL || dir->num_subdirs == 0) {
+        reader_close(&ref->reader);
+        free(ref);
+        return dir;
+    }
+
+    ref->refs = dir->num_subdirs;
+    dir->subdirs = xmalloc(dir->num_subdirs * sizeof(Slot *));
+    for (i = 0; i < dir->num_subdirs; ++i) {
+        sub = new_task(ref, dir->sub_names[i], task->path);
+        dir->subdirs[i] = sub->slot;
+        push_task(worker, sub);
+    }
+
+    dir->sub_names = NULL;
+    return dir;
+}
+
+static void
+push_slot(Slot *slot)
+{
+    if (print_len == print_size) {
+        print_size = print_size ? print_size * 2 : 64;
+        print_stack = xrealloc(print_stack, print_size * sizeof(Slot *));
+    }
+    print_stack[print_len++] = slot;
+}
+
+static void
+release_dir(Dir_data *dir)
+{
+    free_dir(dir);
+
+    pthread_mutex_lock(&pool_lock);
+    --ready;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Print dir, or add it to the dump. */
+static void
+show_dir(Dir_data *dir, int header)
+{
+    size_t i;
+
+    if (dump_path != NULL) {
+        dump_dir(&dump_writer, dir);
+        return;
+    }
+
+    if (output_format != FORMAT_TEXT) {
+        for (i = 0; i < dir->num_files; ++i)
+            print_record(dir, dir->files[i], header);
+        return;
+    }
+
+    if (num_printed++ > 0)
+        out_char('\n');
+
+    if (header) {
+        out_puts(dir->path);
+        out_write(": \n", 3);
+    }
+    print_files(dir);
+}
+
+static void
+print_dir(Dir_data *dir, int header)
+{
+    show_dir(dir, header);
+    release_dir(dir);
+}
+
+/* Print a row of --du. */
+static void
+du_print(const char *path, uint64_t apparent, uint64_t allocated)
+{
+    char num[HR_SIZE];
+
+    switch (output_format)
+    {
+    case FORMAT_JSON:
+        out_puts("{\"dir\":");
+        out_json_string(path);
+        out_puts(",\"apparent\":");
+        out_num(apparent);
+        out_puts(",\"allocated\":");
+        out_num(allocated);
+        out_write("}\n", 2);
+        break;
+
+    case FORMAT_CSV:
+        out_csv_field(path);
+        out_char(',');
+        out_num(apparent);
+        out_char(',');
+        out_num(allocated);
+        out_char('\n');
+        break;
+
+    default:
+        if (f_human_readable) {
+            out_write(num, human_readable(num, apparent));
+            out_char('\t');
+            out_write(num, human_readable(num, allocated));
+        } else {
+            out_num(apparent);
+            out_char('\t');
+            out_num(allocated);
+        }
+        out_char('\t');
+        out_puts(path);
+        out_char(output_format == FORMAT_NUL ? '\0' : '\n');
+        break;
+    }
+}
+
+/* Print every directory on top of du_stack that has all its 
+   subdirectories added, and add it to its parent. */
+static void
+du_close(void)
+{
+    Du_node *node;
+
+    while (du_len > 0 && du_stack[du_len - 1].left == 0) {
+        node = &du_stack[--du_len];
+        if (!f_total_size || node->root)
+            du_print(node->path, node->apparent, node->allocated);
+
+        if (du_len > 0) {
+            du_stack[du_len - 1].apparent += node->apparent;
+            du_stack[du_len - 1].allocated += node->allocated;
+            du_stack[du_len - 1].total_apparent += node->total_apparent;
+            du_stack[du_len - 1].total_allocated += node->total_allocated;
+            du_stack[du_len - 1].left--;
+        } else {
+            du_apparent += node->total_apparent;
+            du_allocated += node->total_allocated;
+        }
+        free(node->path);
+    }
+}
+
+/* Directories come in the order they're printed, each before its
+   subdirectories, so the one on top of du_stack is the parent of 
+   dir, and dir is done once as many have been added as it has 
+   subdirectories. Files with more than one link are charged to the
+   first directory they're seen in, in this order, whichever worker
+   read it. */
+static void
+du_enter(const Dir_data *dir, int root)
+{
+    Du_node *node;
+    const Du_link *link;
+    size_t i;
+    int counted;
+
+    if (du_len == du_size) {
+        du_size = du_size ? du_size * 2 : 64;
+        du_stack = xrealloc(du_stack, du_size * sizeof(Du_node));
+    }
+
+    /* Every argument gets its full size. */
+    if (root)
+        id_set_clear(&arg_links);
+
+    counted = du_total && !id_set_add(&total_dirs, dir->dev, dir->ino);
+
+    node = &du_stack[du_len++];
+    node->path = dupstr(dir->path);
+    node->apparent = dir->apparent;
+    node->allocated = dir->allocated;
+    node->total_apparent = counted ? 0 : dir->apparent;
+    node->total_allocated = counted ? 0 : dir->allocated;
+    node->left = dir->num_subdirs;
+    node->root = root;
+
+    for (i = 0; i < dir->num_links; ++i) {
+        link = &dir->links[i];
+        if (id_set_add(&arg_links, link->dev, link->ino)) {
+            node->apparent += link->apparent;
+            node->allocated += link->allocated;
+        }
+        if (du_total && id_set_add(&total_links, link->dev, link->ino)) {
+            node->total_apparent += link->apparent;
+            node->total_allocated += link->allocated;
+        }
+    }
+    du_close();
+}
+
+/* A subdirectory that couldn't be read adds nothing. */
+static void
+du_skip(void)
+{
+    if (du_len == 0)
+        return;
+
+    du_stack[du_len - 1].left--;
+    du_close();
+}
+
+/* Print and free every directory that's next in line and has 
+   been read. A directory is followed by its subdirectories, the
+   last one read first. */
+static void
+print_ready(void)
+{
+    Slot *slot;
+    Dir_data *dir;
+    size_t i;
+    int root;
+
+    while (print_len > 0) {
+        slot = print_stack[print_len - 1];
+
+        pthread_mutex_lock(&pool_lock);
+        if (!slot->done) {
+            pthread_mutex_unlock(&pool_lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        --print_len;
+        dir = slot->dir;
+        root = slot->root;
+        if (dir == NULL || dir->failed)
+            set_exit_status(root ? 2 : 1);
+        if (dir == NULL && !root && f_du)
+            du_skip();
+        free(slot);
+
+        if (dir == NULL)
+            continue;
+
+        for (i = 0; i < dir->num_subdirs; ++i)
+            push_slot(dir->subdirs[i]);
+
+        if (f_du) {
+            du_enter(dir, root);
+            release_dir(dir);
             continue;
         }
 
-        fpath = xmalloc(path_len + strlen(de->d_name) + 2);
-        sprintf(fpath, "%s/%s", path, de->d_name);
-        
-        if (stat(fpath, &st) == -1) {
-            free(fpath);
-            xerror("failed to stat '%s'", de->d_name);
-            return NULL;
+        /* Already printed while it was read. */
+        if (f_unsorted) {
+            release_dir(dir);
+            continue;
         }
-        
-        dir->files[i] = xmalloc(sizeof(File_data));
-        dir->files[i]->name = dupstr(de->d_name);
-        dir->files[i]->type = get_filetype(de->d_type);
-        if (access(dir->files[i]->name, F_OK|X_OK) == 0 
-        &&  dir->files[i]->type != FT_DIR)
-            dir->files[i]->type = FT_EXEC;
-        else
-            errno = 0; /* Permission denied. */
-
-        dir->files[i]->indicator = get_indicator(dir->files[i]->type);
-        dir->files[i]->nlen = strlen(de->d_name);
-        dir->files[i]->nlink = st.st_nlink;
-        dir->files[i]->mode = get_mode_string(st);
-        dir->files[i]->user = get_user_name(st);
-        dir->files[i]->group = get_group_name(st);
-        dir->files[i]->fsize = st.st_size;
-        dir->files[i]->mtime = 4 + ctime(&(st.st_ctime));
- 
-        if (dir->files[i]->type == FT_DIR && !f_no_classify)
-            dir->files[i]->nlen++;
 
-        row_len += dir->files[i]->nlen + 1;
-        store_longest(dir, dir->files[i]);
+        if (num_printed == 0 && held_dir == NULL) {
+            held_dir = dir;
+            continue;
+        }
+
+        if (held_dir != NULL) {
+            print_dir(held_dir, 1);
+            held_dir = NULL;
+        }
+        print_dir(dir, 1);
+    }
+}
+
+/* Non zero while fewer directories wait to be printed than the 
+   workers may read ahead, called with pool_lock held. */
+static int
+can_read_ahead(void)
+{
+    return ready < READY_PER_JOB * num_jobs;
+}
+
+/* Whether worker has something to do, called with pool_lock held. 
+   Workers hold off while the printer is behind. The first worker
+   also prints, and then still reads the directory it's waiting
+   for when nobody took it yet. */
+static int
+has_work(Worker *worker)
+{
+    Slot *top;
+
+    if (pending == 0)
+        return 1;
+
+    if (worker->id != 0)
+        return queued > 0 && can_read_ahead();
+
+    if (print_len == 0)
+        return queued > 0 && can_read_ahead();
+
+    top = print_stack[print_len - 1];
+    return top->done || (queued > 0 && (can_read_ahead() || !top->taken));
+}
+
+/* Next task for worker, past the read ahead the first worker only
+   takes the one for the directory to print next. */
+static Task *
+next_task(Worker *worker)
+{
+    int wait_for_top;
+
+    if (worker->id != 0 || print_len == 0)
+        return take_task(worker);
+
+    pthread_mutex_lock(&pool_lock);
+    wait_for_top = !can_read_ahead();
+    pthread_mutex_unlock(&pool_lock);
+
+    if (wait_for_top)
+        return take_slot_task(print_stack[print_len - 1]);
+    return take_task(worker);
+}
+
+static void *
+work(void *arg)
+{
+    Worker *worker = arg;
+    Task *task;
+    Dir_data *dir;
+
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (!has_work(worker))
+            pthread_cond_wait(&pool_cond, &pool_lock);
 
-        if (j * ALLOC >= i) {
-            ++j;
-            dir->files = xrealloc(dir->files, (ALLOC * j) * sizeof(File_data *));
+        if (pending == 0) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
         }
+        pthread_mutex_unlock(&pool_lock);
+
+        if (worker->id == 0)
+            print_ready();
+
+        if ((task = next_task(worker)) == NULL)
+            continue;
 
-        if (dir->files[i]->type == FT_DIR && f_recursive)
-            get_files(fpath);
+        dir = run_task(worker, task);
 
-        free(fpath);
+        pthread_mutex_lock(&pool_lock);
+        task->slot->dir = dir;
+        task->slot->done = 1;
+        if (dir != NULL)
+            ++ready;
+        --pending;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+
+        free_task(task);
     }
 
-    if (errno != 0)
-        xerror("an error occured while reading '%s'", path);
+    free_stat_ring();
+    return NULL;
+}
 
-    closedir(d);
-    dir->path = dupstr(path);
-    dir->files[i + 1] = NULL;
-    dir->num_rows = i / (window_width / (dir->lname + 1)) + 1;
-    qsort(dir->files, i, sizeof(File_data *), sort_by_name);
-    dir->num_files = i;
-    ++num_dirs;
-    if (dirs == NULL)
-        dirs = xmalloc(sizeof(Dir_data *));
-    else 
-        dirs = xrealloc(dirs, sizeof(Dir_data *) * (num_dirs));
-    dirs[num_dirs - 1] = dir;
+/* Read and print every directory in args, and with -R everything 
+   below them, using num_jobs workers. The calling thread is the 
+   first worker and prints each directory as soon as it's next in
+   line, so only the directories in between are kept in memory. */
+static void
+read_dirs(char **args, size_t num_args)
+{
+    size_t i;
+    Task *task;
+
+    workers = xmalloc(num_jobs * sizeof(Worker));
+    for (i = 0; i < num_jobs; ++i) {
+        workers[i].id = i;
+        workers[i].deque.tasks = NULL;
+        workers[i].deque.head = workers[i].deque.tail = workers[i].deque.size = 0;
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+    }
 
-    return dir;
+    /* Directories are printed in reverse order of the arguments. */
+    for (i = 0; i < num_args; ++i) {
+        task = new_task(NULL, args[i], NULL);
+        push_slot(task->slot);
+        push_task(&workers[0], task);
+    }
+
+    for (i = 1; i < num_jobs; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            xerror("failed to start worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    work(&workers[0]);
+
+    for (i = 1; i < num_jobs; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    for (i = 0; i < num_jobs; ++i) {
+        pthread_mutex_destroy(&workers[i].deque.lock);
+        free(workers[i].deque.tasks);
+    }
+    free(workers);
+
+    print_ready();
+    if (held_dir != NULL) {
+        print_dir(held_dir, 0);
+        held_dir = NULL;
+    }
+    free(print_stack);
+}
+
+/* Print the listing in the dump at path as if it was read from 
+   disk, with the flags given now. */
+static void
+load_dump(const char *path)
+{
+    Dump dump;
+    Dir_data *dir;
+    size_t i;
+
+    if (!dump_map(&dump, path)) {
+        xerror("failed to load '%s'", path);
+        exit_status = 2;
+        return;
+    }
+
+    time_type = dump.header->time_type;
+    if (dump.header->flags & DUMP_RECURSIVE)
+        f_recursive = 1;
+
+    for (i = 0; i < dump.header->num_dirs; ++i) {
+        if ((dir = load_dir(&dump, &dump.dirs[i], 0)) == NULL) {
+            xerror("'%s' is corrupt", path);
+            exit_status = 2;
+            break;
+        }
+        show_dir(dir, dump.header->num_dirs > 1);
+        free_dir(dir);
+    }
+
+    munmap(dump.map, dump.size);
 }
 
 int 
 ls(char **args)
 {
-    size_t i;
-    int status = EXIT_SUCCESS;
+    size_t num_args;
+    struct winsize w;
 
     if (!isatty(1))
         print_file_nl = 1;
 
     args = get_options(args, flags);
 
+    /* Sizes of whole trees, hidden files included. Only -I still 
+       leaves files out. */
+    if (f_total_size)
+        f_du = 1;
+    if (f_du) {
+        if (dump_path != NULL || load_path != NULL) {
+            errno = 0;
+            xerror("--du can't be used with --dump or --load");
+            return 2;
+        }
+        ignore_files = (ignore_files & ~I_HIDDEN) | I_DOTS;
+        f_recursive = 1;
+        f_unsorted = 0;
+        f_long_format = 0;
+        f_no_color = 1;
+        f_no_classify = 1;
+        stat_flags = AT_SYMLINK_NOFOLLOW;
+    }
+
+    /* Records are printed as they are, without colours, indicators
+       or anything that needs widths. */
+    if (output_format != FORMAT_TEXT && dump_path == NULL) {
+        f_long_format = 0;
+        f_human_readable = 0;
+        f_no_color = 1;
+        f_no_classify = 1;
+    }
+
+    /* Dumps keep the raw numbers, executables are still told apart 
+       as they would be when printing. */
+    if (dump_path != NULL) {
+        if (load_path != NULL) {
+            errno = 0;
+            xerror("--dump and --load can't be used together");
+            return 2;
+        }
+        f_long_format = 0;
+        f_human_readable = 0;
+    }
+
+    if (f_collate)
+        setlocale(LC_COLLATE, "");
+
+    tzset();
+    now = time(NULL);
+    init_mode_table();
+
     if (*args == NULL) {
         args[0] = dupstr(".");
         args[1] = NULL;
     }
 
-    for (i = 0; args[i] != NULL; ++i) {
-        if (!get_files(args[i]))
-            status = 2;
+    ioctl(0, TIOCGWINSZ, &w);
+    window_width = w.ws_col;
+
+    /* Load the id tables before workers share them. */
+    if (f_long_format && num_jobs > 1) {
+        user_name(0);
+        group_name(0);
+    }
+
+    for (num_args = 0; args[num_args] != NULL; ++num_args)
+        ;
+
+    if (output_format == FORMAT_CSV && f_du)
+        out_puts("dir,apparent,allocated\n");
+    else
+    if (output_format == FORMAT_CSV && dump_path == NULL)
+        out_puts("dir,name,type,mode,nlink,uid,gid,size,time,time_nsec\n");
+
+    if (load_path != NULL) {
+        load_dump(load_path);
+        out_flush();
+        return exit_status;
+    }
+
+    /* Entries are printed by the worker reading them, so there
+       can only be one, and there's no room for columns. */
+    if (f_unsorted) {
+        num_jobs = 1;
+        print_file_nl = 1;
+        unsorted_headers = f_recursive || num_args > 1;
     }
 
-    for (i = num_dirs; i--;) {
-        if (num_dirs > 1)
-            fprintf(stdout, "%s: \n", dirs[i]->path);
-        print_files(dirs[i]);
-        if (i > 0) fputc('\n', stdout);
+    if (dump_path != NULL && !dump_start(&dump_writer, dump_path))
+        return 2;
+
+    if (f_cache)
+        cache_init();
+
+    du_total = f_du && num_args > 1;
+    read_dirs(args, num_args);
+
+    if (f_du) {
+        if (du_total)
+            du_print("total", du_apparent, du_allocated);
+        free(du_stack);
+        free(arg_links.ids);
+        free(total_dirs.ids);
+        free(total_links.ids);
     }
 
-    num_dirs = 0;
-    free_dirs();
+    if (dump_path != NULL && !dump_finish(&dump_writer))
+        exit_status = 2;
+    out_flush();
 
-    return status;
+    return exit_status;
 }
 
 int 
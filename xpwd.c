@@ -75,22 +75,33 @@ usage(void)
 static void 
 print_cwd(void)
 {
-    size_t i, len;
-    char c;
-
-    len = strlen(cwd);
-    set_color(C_WHITE, CT_LIGHT); 
-
-    for (i = 0; i < len; ++i) {
-        c = cwd[i];
-        if (c == '/')
-            set_color(C_RED, CT_NORMAL);
-        fputc(c, stdout);
-        if (c == '/')
-            set_color(C_WHITE, CT_LIGHT); 
+    const char *light = color_code(C_WHITE, CT_LIGHT);
+    const char *slash = color_code(C_RED, CT_NORMAL);
+    const char *p, *next;
+    size_t len = 0;
+    char *buf;
+
+    /* Each '/' is wrapped in two escape sequences. */
+    buf = xmalloc(COLOR_SIZE + strlen(cwd) * (2 * COLOR_CODE_SIZE + 1) + 2);
+    memcpy(buf, light, COLOR_CODE_SIZE);
+    len += COLOR_CODE_SIZE;
+
+    for (p = cwd; (next = strchr(p, '/')) != NULL; p = next + 1) {
+        memcpy(buf + len, p, next - p);
+        len += next - p;
+        memcpy(buf + len, slash, COLOR_CODE_SIZE);
+        len += COLOR_CODE_SIZE;
+        buf[len++] = '/';
+        memcpy(buf + len, light, COLOR_CODE_SIZE);
+        len += COLOR_CODE_SIZE;
     }
+    memcpy(buf + len, p, strlen(p));
+    len += strlen(p);
+
+    fwrite(buf, 1, len, stdout);
     clear_color();
     fputc('\n', stdout);
+    free(buf);
 }
 
 static int